@@ -0,0 +1,53 @@
+#include "alias_table.hpp"
+
+void alias_table::build(std::vector<float> const& weights) {
+	probability.clear();
+	alias.clear();
+
+	double total = 0.0;
+	for (auto weight : weights) {
+		if (weight > 0.f) total += weight;
+	}
+	if (total <= 0.0) return;
+
+	auto size = weights.size();
+	probability.resize(size);
+	alias.resize(size);
+
+	std::vector<double> scaled(size);
+	std::vector<uint32_t> small;
+	std::vector<uint32_t> large;
+	for (uint32_t i = 0; i < size; i++) {
+		scaled[i] = (weights[i] > 0.f ? weights[i] : 0.0) * size / total;
+		if (scaled[i] < 1.0) {
+			small.push_back(i);
+		} else {
+			large.push_back(i);
+		}
+	}
+
+	while (!small.empty() && !large.empty()) {
+		auto less = small.back();
+		small.pop_back();
+		auto more = large.back();
+
+		probability[less] = (float)scaled[less];
+		alias[less] = more;
+
+		scaled[more] = (scaled[more] + scaled[less]) - 1.0;
+		if (scaled[more] < 1.0) {
+			large.pop_back();
+			small.push_back(more);
+		}
+	}
+
+	// whatever is left is full up to rounding errors
+	for (auto i : large) {
+		probability[i] = 1.f;
+		alias[i] = i;
+	}
+	for (auto i : small) {
+		probability[i] = 1.f;
+		alias[i] = i;
+	}
+}
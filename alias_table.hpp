@@ -0,0 +1,31 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+/*
+
+Walker/Vose alias table: draws an index with probability proportional to its weight in constant time.
+Building costs O(n), so tables are rebuilt only when weights change.
+
+*/
+
+struct alias_table {
+	// chance to keep the column instead of taking its alias
+	std::vector<float> probability;
+	std::vector<uint32_t> alias;
+
+	// negative weights count as zero, all zero weights make an empty table
+	void build(std::vector<float> const& weights);
+
+	bool empty() const {
+		return probability.empty();
+	}
+
+	// engine has to produce 32 random bits per call, like std::mt19937
+	template<typename Engine>
+	uint32_t sample(Engine& engine) const {
+		auto column = (uint32_t)(((uint64_t)(uint32_t)engine() * probability.size()) >> 32);
+		auto coin = (float)((uint32_t)engine() >> 8) * (1.f / 16777216.f);
+		return coin < probability[column] ? column : alias[column];
+	}
+};
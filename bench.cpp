@@ -0,0 +1,177 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <oneapi/tbb/global_control.h>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "data_ids.hpp"
+#include "simulation.hpp"
+#include "constants.hpp"
+
+/*
+
+Headless benchmark of simulation_update.
+Builds a synthetic world through the same request functions the server uses
+and reports tick latency percentiles and memory usage.
+
+	./bench [users] [buildings per user] [ticks] [dense|sparse stockpiles] [threads, 0 for all]
+
+The world seed is fixed, so the checksum printed at the end has to be the same
+for any number of threads: compare a run with 1 thread against one with all of them.
+
+*/
+
+// indices of entities created by init_simulation
+static const dcon::building_type_id extractor {dcon::building_type_id::value_base_t(1)};
+static const dcon::commodity_id ore_basic {dcon::commodity_id::value_base_t(0)};
+static const dcon::commodity_id ore_basic_source {dcon::commodity_id::value_base_t(3)};
+
+static constexpr int max_gacha_buildings = 10;
+static constexpr int warmup_ticks = 10;
+static constexpr uint64_t bench_seed = 0x011BE7C4;
+
+struct request_counters {
+	uint64_t accepted = 0;
+	uint64_t rejected = 0;
+	uint64_t queue_full = 0;
+
+	void count(request_status status) {
+		switch (status) {
+		case request_status::accepted: accepted++; break;
+		case request_status::rejected: rejected++; break;
+		case request_status::queue_full: queue_full++; break;
+		}
+	}
+};
+
+static int read_argument(int argc, char** argv, int index, int fallback) {
+	if (argc <= index) return fallback;
+	return atoi(argv[index]);
+}
+
+static double resident_megabytes() {
+	long pages = 0;
+	long resident = 0;
+	FILE* statm = fopen("/proc/self/statm", "r");
+	if (!statm) return 0;
+	if (fscanf(statm, "%ld %ld", &pages, &resident) != 2) resident = 0;
+	fclose(statm);
+	return double(resident) * sysconf(_SC_PAGESIZE) / (1024.0 * 1024.0);
+}
+
+static double peak_megabytes() {
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return double(usage.ru_maxrss) / 1024.0;
+}
+
+static double percentile(std::vector<double> const& sorted, double p) {
+	if (sorted.empty()) return 0;
+	auto index = (size_t)(p * (sorted.size() - 1));
+	return sorted[index];
+}
+
+int main(int argc, char** argv) {
+	int users_count = read_argument(argc, argv, 1, 1000);
+	int buildings_per_user = read_argument(argc, argv, 2, 10);
+	int ticks = read_argument(argc, argv, 3, 100);
+	bool sparse = argc > 4 && strcmp(argv[4], "sparse") == 0;
+	int threads = read_argument(argc, argv, 5, 0);
+	std::unique_ptr<tbb::global_control> thread_limit;
+	if (threads > 0) {
+		thread_limit = std::make_unique<tbb::global_control>(tbb::global_control::max_allowed_parallelism, threads);
+	}
+
+	configure_stockpiles(sparse ? inventory_layout::sparse : inventory_layout::dense);
+	configure_command_queues(std::max<size_t>(default_command_queue_capacity, size_t(users_count) * (buildings_per_user + 2)));
+	init_simulation();
+	set_world_seed(bench_seed);
+
+	request_counters counters;
+
+	std::vector<dcon::user_id> users;
+	for (int i = 0; i < users_count; i++) {
+		uint8_t password_hash[HASHLEN] {};
+		memcpy(password_hash, &i, sizeof(i));
+		users.push_back(create_or_get_user("bench" + std::to_string(i), password_hash));
+	}
+	simulation_update();
+
+	// buildings: lottery first, then constructions paid with savings
+	for (auto user : users) {
+		counters.count(request_gacha(user, std::min(buildings_per_user, max_gacha_buildings)));
+		for (int i = max_gacha_buildings; i < buildings_per_user; i++) {
+			counters.count(request_new_building(user, extractor));
+		}
+	}
+	simulation_update();
+
+	// every building is busy and passes its output along a chain ending in the personal storage
+	{
+		auto view = acquire_view();
+		for (auto user : users) {
+			auto buildings = retrieve_owned_buildings(*view, user);
+			for (size_t i = 0; i < buildings.size(); i++) {
+				counters.count(request_settings_change(user, buildings[i], 0));
+				auto source = retrieve_building_storage(*view, buildings[i]);
+				auto target = i + 1 < buildings.size()
+					? retrieve_building_storage(*view, buildings[i + 1])
+					: retrieve_user_storage(*view, user);
+				counters.count(request_transfer(user, source, target, ore_basic_source, 1));
+			}
+		}
+	}
+
+	for (int i = 0; i < warmup_ticks; i++) {
+		simulation_update();
+	}
+
+	std::vector<double> durations;
+	durations.reserve(ticks);
+	for (int tick = 0; tick < ticks; tick++) {
+		// keep both sides of the books busy
+		for (size_t i = 0; i < users.size(); i++) {
+			auto user = users[i];
+			auto price = 1 + (tick + i) % 10;
+			counters.count(request_demand(user, ore_basic_source, price, 1));
+			counters.count(request_supply(user, ore_basic_source, price, 1));
+			counters.count(request_demand(user, ore_basic, price, 1));
+		}
+
+		auto start = std::chrono::steady_clock::now();
+		simulation_update();
+		auto duration = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start);
+		durations.push_back(duration.count());
+	}
+
+	std::sort(durations.begin(), durations.end());
+	double total = 0;
+	for (auto value : durations) {
+		total += value;
+	}
+
+	printf("users %d, buildings per user %d, ticks %d, %s stockpiles\n", users_count, buildings_per_user, ticks, sparse ? "sparse" : "dense");
+	printf(
+		"requests: %llu accepted, %llu rejected, %llu dropped by full queues\n",
+		(unsigned long long)counters.accepted,
+		(unsigned long long)counters.rejected,
+		(unsigned long long)counters.queue_full
+	);
+	printf(
+		"tick ms: mean %.3f, p50 %.3f, p99 %.3f, max %.3f\n",
+		durations.empty() ? 0 : total / durations.size(),
+		percentile(durations, 0.5),
+		percentile(durations, 0.99),
+		durations.empty() ? 0 : durations.back()
+	);
+	printf("memory MB: resident %.1f, peak %.1f\n", resident_megabytes(), peak_megabytes());
+	printf("threads %s, world checksum %016llx\n", threads > 0 ? std::to_string(threads).c_str() : "all", (unsigned long long)world_checksum());
+	return 0;
+}
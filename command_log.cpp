@@ -0,0 +1,98 @@
+#include "command_log.hpp"
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+uint32_t log_checksum(void const* data, size_t size) {
+	// FNV-1a
+	uint32_t hash = 2166136261u;
+	auto bytes = (uint8_t const*) data;
+	for (size_t i = 0; i < size; i++) {
+		hash = (hash ^ bytes[i]) * 16777619u;
+	}
+	return hash;
+}
+
+bool command_log_writer::open(const char* path) {
+	std::lock_guard<std::mutex> lock {mtx};
+	if (file) fclose(file);
+	file = fopen(path, "ab");
+	return file != nullptr;
+}
+
+void command_log_writer::close() {
+	std::lock_guard<std::mutex> lock {mtx};
+	if (!file) return;
+	fflush(file);
+	fdatasync(fileno(file));
+	fclose(file);
+	file = nullptr;
+}
+
+void command_log_writer::append(log_record_type type, uint64_t tick, void const* data, uint32_t size) {
+	std::lock_guard<std::mutex> lock {mtx};
+	if (!file) return;
+	log_record_header header {};
+	header.tick = tick;
+	header.size = size;
+	header.checksum = log_checksum(data, size);
+	header.type = type;
+	fwrite(&header, sizeof(header), 1, file);
+	fwrite(data, 1, size, file);
+}
+
+void command_log_writer::sync() {
+	std::lock_guard<std::mutex> lock {mtx};
+	if (!file) return;
+	fflush(file);
+	fdatasync(fileno(file));
+}
+
+void command_log_writer::truncate() {
+	std::lock_guard<std::mutex> lock {mtx};
+	if (!file) return;
+	fflush(file);
+	ftruncate(fileno(file), 0);
+	fdatasync(fileno(file));
+}
+
+bool command_log_reader::open(const char* path) {
+	int fd = ::open(path, O_RDONLY);
+	if (fd < 0) return false;
+	struct stat info;
+	if (fstat(fd, &info) != 0) {
+		::close(fd);
+		return false;
+	}
+	size = info.st_size;
+	position = 0;
+	if (size == 0) {
+		::close(fd);
+		return true;
+	}
+	auto mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (mapped == MAP_FAILED) {
+		size = 0;
+		return false;
+	}
+	begin = (std::byte const*) mapped;
+	return true;
+}
+
+bool command_log_reader::next(log_record& record) {
+	if (position + sizeof(log_record_header) > size) return false;
+	memcpy(&record.header, begin + position, sizeof(log_record_header));
+	auto payload = position + sizeof(log_record_header);
+	if (payload + record.header.size > size) return false;
+	record.data = begin + payload;
+	if (log_checksum(record.data, record.header.size) != record.header.checksum) return false;
+	position = payload + record.header.size;
+	return true;
+}
+
+command_log_reader::~command_log_reader() {
+	if (begin) munmap((void*) begin, size);
+}
@@ -0,0 +1,65 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <type_traits>
+
+/*
+
+Append-only binary log of commands applied by the simulation.
+Every record is a fixed header followed by a payload of header.size bytes.
+Readers stop at the first torn or corrupted record.
+
+*/
+
+enum class log_record_type : uint8_t {
+	tick, user, gacha, construction, settings, transfer, demand, supply
+};
+
+struct log_record_header {
+	uint64_t tick;
+	uint32_t size;
+	uint32_t checksum;
+	log_record_type type;
+	uint8_t padding[7];
+};
+
+struct log_record {
+	log_record_header header;
+	std::byte const* data;
+};
+
+struct command_log_writer {
+	FILE* file = nullptr;
+	std::mutex mtx;
+
+	bool open(const char* path);
+	void close();
+	bool is_open() const { return file != nullptr; }
+
+	void append(log_record_type type, uint64_t tick, void const* data, uint32_t size);
+
+	template<typename T>
+	void append(log_record_type type, uint64_t tick, T const& item) {
+		static_assert(std::is_trivially_copyable_v<T>);
+		append(type, tick, &item, sizeof(T));
+	}
+
+	// flushes buffered records and waits until they reach the disk
+	void sync();
+	// drops every record, used after a snapshot made them redundant
+	void truncate();
+};
+
+struct command_log_reader {
+	std::byte const* begin = nullptr;
+	size_t size = 0;
+	size_t position = 0;
+
+	bool open(const char* path);
+	bool next(log_record& record);
+	~command_log_reader();
+};
+
+uint32_t log_checksum(void const* data, size_t size);
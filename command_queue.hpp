@@ -0,0 +1,98 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+/*
+
+Bounded lock-free queue with many producers and one consumer.
+Every cell carries a sequence number which tells whose turn it is:
+producers claim a position with one CAS, the consumer never waits for them.
+
+*/
+
+template<typename T>
+struct command_queue {
+	struct cell {
+		std::atomic<size_t> sequence;
+		T item;
+	};
+
+	std::unique_ptr<cell[]> cells;
+	size_t mask = 0;
+
+	alignas(64) std::atomic<size_t> write_position {0};
+	alignas(64) std::atomic<size_t> read_position {0};
+
+	std::atomic<uint64_t> accepted {0};
+	std::atomic<uint64_t> dropped {0};
+
+	// larger requests are clamped, the capacity is rounded up to a power of two
+	static constexpr size_t max_capacity = size_t(1) << 20;
+
+	explicit command_queue(size_t capacity) {
+		reserve(capacity);
+	}
+
+	// Not thread safe: call before producers start.
+	void reserve(size_t requested_capacity) {
+		size_t capacity = 2;
+		while (capacity < requested_capacity && capacity < max_capacity) {
+			capacity <<= 1;
+		}
+		cells = std::make_unique<cell[]>(capacity);
+		for (size_t i = 0; i < capacity; i++) {
+			cells[i].sequence.store(i, std::memory_order_relaxed);
+		}
+		mask = capacity - 1;
+		write_position.store(0, std::memory_order_relaxed);
+		read_position.store(0, std::memory_order_relaxed);
+	}
+
+	bool push(T const& item) {
+		auto position = write_position.load(std::memory_order_relaxed);
+		while (true) {
+			auto& target = cells[position & mask];
+			auto sequence = target.sequence.load(std::memory_order_acquire);
+			auto difference = (intptr_t)sequence - (intptr_t)position;
+			if (difference == 0) {
+				if (write_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+					target.item = item;
+					target.sequence.store(position + 1, std::memory_order_release);
+					accepted.fetch_add(1, std::memory_order_relaxed);
+					return true;
+				}
+			} else if (difference < 0) {
+				dropped.fetch_add(1, std::memory_order_relaxed);
+				return false;
+			} else {
+				position = write_position.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	// Consumer only.
+	bool pop(T& item) {
+		auto position = read_position.load(std::memory_order_relaxed);
+		auto& source = cells[position & mask];
+		auto sequence = source.sequence.load(std::memory_order_acquire);
+		if ((intptr_t)sequence - (intptr_t)(position + 1) < 0) {
+			return false;
+		}
+		item = source.item;
+		source.sequence.store(position + mask + 1, std::memory_order_release);
+		read_position.store(position + 1, std::memory_order_relaxed);
+		return true;
+	}
+
+	size_t depth() const {
+		auto written = write_position.load(std::memory_order_relaxed);
+		auto read = read_position.load(std::memory_order_relaxed);
+		return written > read ? written - read : 0;
+	}
+
+	size_t capacity() const {
+		return mask + 1;
+	}
+};
@@ -0,0 +1,179 @@
+#include "command_ticket.hpp"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <format>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+enum class ticket_state : uint8_t {
+	free, claimed, waiting, resolved
+};
+
+// generation in the high half, outcome and state in the low bytes
+static uint64_t pack(uint32_t generation, ticket_state state, command_outcome outcome = command_outcome::applied) {
+	return (uint64_t(generation) << 32) | (uint64_t(outcome) << 8) | uint64_t(state);
+}
+static uint32_t generation_of(uint64_t word) { return uint32_t(word >> 32); }
+static ticket_state state_of(uint64_t word) { return ticket_state(word & 0xff); }
+static command_outcome outcome_of(uint64_t word) { return command_outcome((word >> 8) & 0xff); }
+
+struct ticket_slot {
+	std::atomic<uint64_t> word {0};
+	std::atomic<int64_t> deadline {0};
+	void* waiter = nullptr;
+};
+
+static std::unique_ptr<ticket_slot[]> slots;
+static size_t slots_count = 0;
+static std::chrono::milliseconds ticket_timeout {0};
+static ticket_waker waker = nullptr;
+
+static std::atomic<size_t> claim_cursor {0};
+static std::atomic<bool> closing {false};
+static std::atomic<uint64_t> claimed_total {0};
+static std::atomic<uint64_t> exhausted_total {0};
+static std::atomic<uint64_t> timed_out_total {0};
+
+static std::mutex sweeper_mutex;
+static std::condition_variable sweeper_wake;
+static bool sweeper_stopping = false;
+static std::thread sweeper;
+
+static int64_t now_ticks() {
+	return std::chrono::steady_clock::now().time_since_epoch().count();
+}
+
+// the only way out of the waiting state, the winner of the CAS wakes the waiter
+static bool resolve_slot(ticket_slot& slot, uint64_t expected, command_outcome outcome) {
+	if (state_of(expected) != ticket_state::waiting) return false;
+	auto resolved = pack(generation_of(expected), ticket_state::resolved, outcome);
+	if (!slot.word.compare_exchange_strong(expected, resolved, std::memory_order_acq_rel)) return false;
+	waker(slot.waiter);
+	return true;
+}
+
+static void sweep(bool everything) {
+	auto now = now_ticks();
+	for (size_t i = 0; i < slots_count; i++) {
+		auto& slot = slots[i];
+		auto word = slot.word.load(std::memory_order_seq_cst);
+		if (state_of(word) != ticket_state::waiting) continue;
+		// a recycled slot has a new generation, so a stale deadline never resolves it
+		if (!everything && slot.deadline.load(std::memory_order_relaxed) > now) continue;
+		if (resolve_slot(slot, word, command_outcome::timed_out)) {
+			timed_out_total.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+}
+
+void start_command_tickets(size_t capacity, std::chrono::milliseconds timeout, ticket_waker wake) {
+	slots_count = std::max<size_t>(capacity, 1);
+	slots = std::make_unique<ticket_slot[]>(slots_count);
+	ticket_timeout = timeout;
+	waker = wake;
+	closing.store(false);
+	sweeper_stopping = false;
+
+	auto period = std::clamp<std::chrono::milliseconds>(timeout / 4, std::chrono::milliseconds(10), std::chrono::milliseconds(100));
+	sweeper = std::thread([period]() {
+		std::unique_lock<std::mutex> lock {sweeper_mutex};
+		while (!sweeper_wake.wait_for(lock, period, []() { return sweeper_stopping; })) {
+			sweep(false);
+		}
+	});
+}
+
+void stop_command_tickets() {
+	if (!slots) return;
+	closing.store(true, std::memory_order_seq_cst);
+	{
+		std::lock_guard<std::mutex> lock {sweeper_mutex};
+		sweeper_stopping = true;
+	}
+	sweeper_wake.notify_all();
+	if (sweeper.joinable()) sweeper.join();
+	sweep(true);
+}
+
+command_ticket claim_ticket() {
+	if (!slots || closing.load(std::memory_order_relaxed)) return {};
+	auto start = claim_cursor.fetch_add(1, std::memory_order_relaxed);
+	for (size_t i = 0; i < slots_count; i++) {
+		auto index = (start + i) % slots_count;
+		auto& slot = slots[index];
+		auto word = slot.word.load(std::memory_order_relaxed);
+		if (state_of(word) != ticket_state::free) continue;
+		auto generation = generation_of(word);
+		if (slot.word.compare_exchange_strong(word, pack(generation, ticket_state::claimed), std::memory_order_acquire)) {
+			claimed_total.fetch_add(1, std::memory_order_relaxed);
+			return {(uint32_t)index, generation};
+		}
+	}
+	exhausted_total.fetch_add(1, std::memory_order_relaxed);
+	return {};
+}
+
+void arm_ticket(command_ticket ticket, void* waiter) {
+	auto& slot = slots[ticket.slot];
+	slot.waiter = waiter;
+	auto deadline = std::chrono::steady_clock::now() + ticket_timeout;
+	slot.deadline.store(deadline.time_since_epoch().count(), std::memory_order_relaxed);
+	slot.word.store(pack(ticket.generation, ticket_state::waiting), std::memory_order_seq_cst);
+	// either stop_command_tickets sees this ticket or this sees it stopping
+	if (closing.load(std::memory_order_seq_cst)) {
+		resolve_ticket(ticket, command_outcome::timed_out);
+	}
+}
+
+void resolve_ticket(command_ticket ticket, command_outcome outcome) {
+	if (!ticket || !slots || ticket.slot >= slots_count) return;
+	auto& slot = slots[ticket.slot];
+	resolve_slot(slot, pack(ticket.generation, ticket_state::waiting), outcome);
+}
+
+// a new generation makes every copy of the old ticket stale
+static void free_slot(ticket_slot& slot, uint64_t expected) {
+	slot.word.compare_exchange_strong(
+		expected,
+		pack(generation_of(expected) + 1, ticket_state::free),
+		std::memory_order_release
+	);
+}
+
+std::optional<command_outcome> take_ticket(command_ticket ticket) {
+	if (!ticket) return {};
+	auto& slot = slots[ticket.slot];
+	auto word = slot.word.load(std::memory_order_acquire);
+	if (generation_of(word) != ticket.generation || state_of(word) != ticket_state::resolved) return {};
+	free_slot(slot, word);
+	return outcome_of(word);
+}
+
+void close_ticket(command_ticket ticket) {
+	if (!ticket || !slots) return;
+	auto& slot = slots[ticket.slot];
+	auto word = slot.word.load(std::memory_order_acquire);
+	if (generation_of(word) != ticket.generation) return;
+	if (state_of(word) == ticket_state::resolved || state_of(word) == ticket_state::claimed) {
+		free_slot(slot, word);
+	}
+}
+
+void write_ticket_metrics(std::string& result) {
+	size_t pending = 0;
+	for (size_t i = 0; i < slots_count; i++) {
+		if (state_of(slots[i].word.load(std::memory_order_relaxed)) != ticket_state::free) pending++;
+	}
+	result += "# TYPE command_tickets_pending gauge\n";
+	result += std::format("command_tickets_pending {}\n", pending);
+	result += "# TYPE command_tickets_capacity gauge\n";
+	result += std::format("command_tickets_capacity {}\n", slots_count);
+	result += "# TYPE command_tickets_claimed_total counter\n";
+	result += std::format("command_tickets_claimed_total {}\n", claimed_total.load(std::memory_order_relaxed));
+	result += "# TYPE command_tickets_exhausted_total counter\n";
+	result += std::format("command_tickets_exhausted_total {}\n", exhausted_total.load(std::memory_order_relaxed));
+	result += "# TYPE command_tickets_timed_out_total counter\n";
+	result += std::format("command_tickets_timed_out_total {}\n", timed_out_total.load(std::memory_order_relaxed));
+}
@@ -0,0 +1,46 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <string>
+
+/*
+
+Tickets let a request wait for the tick which applies its command.
+A ticket is a slot with one atomic word holding its generation, state and outcome:
+exactly one of the simulation, the timeout sweeper or the submitter resolves it
+and wakes the waiter, stale tickets of recycled slots lose every CAS.
+
+*/
+
+enum class command_outcome : uint8_t {
+	applied, rejected, queue_full, timed_out
+};
+
+struct command_ticket {
+	uint32_t slot = UINT32_MAX;
+	uint32_t generation = 0;
+
+	explicit operator bool() const { return slot != UINT32_MAX; }
+};
+
+// wakes the waiter given to arm_ticket, called from whichever thread resolved the ticket
+using ticket_waker = void (*)(void* waiter);
+
+// Not thread safe: call before requests arrive. Starts the sweeper of expired tickets.
+void start_command_tickets(size_t capacity, std::chrono::milliseconds timeout, ticket_waker wake);
+// resolves every pending ticket as timed out, new tickets can't be claimed anymore
+void stop_command_tickets();
+
+// empty when every slot is taken
+command_ticket claim_ticket();
+// the ticket can be resolved from now on, the waiter must already be able to be woken
+void arm_ticket(command_ticket ticket, void* waiter);
+// does nothing for empty tickets or tickets which were already resolved
+void resolve_ticket(command_ticket ticket, command_outcome outcome);
+// frees a resolved ticket and returns its outcome, empty while it is still pending
+std::optional<command_outcome> take_ticket(command_ticket ticket);
+// frees the ticket of a connection which went away, pending tickets are freed by take_ticket later
+void close_ticket(command_ticket ticket);
+
+void write_ticket_metrics(std::string& result);
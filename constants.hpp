@@ -4,4 +4,5 @@
 
 static constexpr size_t HASHLEN = 32;
 static constexpr size_t SALTLEN = 16;
-static constexpr size_t MAXNAMESIZE = 32;
\ No newline at end of file
+static constexpr size_t MAXNAMESIZE = 32;
+static constexpr size_t default_command_queue_capacity = 4096;
\ No newline at end of file
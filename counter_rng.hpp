@@ -0,0 +1,68 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <limits>
+
+/*
+
+Counter based random numbers (Philox4x32-10).
+A stream is a pure function of (world seed, tick, entity, stream kind),
+so phases may draw in parallel without sharing an engine
+and a recorded world seed reproduces every draw of a tick.
+
+*/
+
+enum class rng_stream : uint32_t {
+	gacha = 1,
+};
+
+inline std::array<uint32_t, 4> philox4x32_10(std::array<uint32_t, 4> counter, std::array<uint32_t, 2> key) {
+	constexpr uint32_t multiplier_0 = 0xD2511F53;
+	constexpr uint32_t multiplier_1 = 0xCD9E8D57;
+	constexpr uint32_t weyl_0 = 0x9E3779B9;
+	constexpr uint32_t weyl_1 = 0xBB67AE85;
+	for (int round = 0; round < 10; round++) {
+		uint64_t product_0 = (uint64_t)multiplier_0 * counter[0];
+		uint64_t product_1 = (uint64_t)multiplier_1 * counter[2];
+		counter = {
+			(uint32_t)(product_1 >> 32) ^ counter[1] ^ key[0],
+			(uint32_t)product_1,
+			(uint32_t)(product_0 >> 32) ^ counter[3] ^ key[1],
+			(uint32_t)product_0
+		};
+		key[0] += weyl_0;
+		key[1] += weyl_1;
+	}
+	return counter;
+}
+
+// satisfies UniformRandomBitGenerator, every call consumes 32 bits of the stream
+struct random_stream {
+	using result_type = uint32_t;
+
+	std::array<uint32_t, 2> key;
+	std::array<uint32_t, 4> counter;
+	std::array<uint32_t, 4> block {};
+	uint32_t used = 4;
+
+	random_stream(uint64_t world_seed, uint64_t tick, uint32_t entity, rng_stream stream)
+		: key {(uint32_t)world_seed, (uint32_t)(world_seed >> 32) ^ (uint32_t)(tick >> 32)}
+		, counter {0, entity, (uint32_t)tick, (uint32_t)stream}
+	{}
+
+	uint32_t operator()() {
+		if (used == 4) {
+			block = philox4x32_10(counter, key);
+			counter[0]++;
+			used = 0;
+		}
+		return block[used++];
+	}
+
+	static constexpr uint32_t min() {
+		return 0;
+	}
+	static constexpr uint32_t max() {
+		return std::numeric_limits<uint32_t>::max();
+	}
+};
@@ -1,56 +1,73 @@
 #include "html-gen.hpp"
 #include "chrono"
-#include <format>
 #include <string>
+#include "html_writer.hpp"
 #include "simulation.hpp"
 #include "url.hpp"
 
-static std::string footer() {
+static void footer(html_writer& out) {
 	const auto now = std::chrono::system_clock::now();
-	auto time_string = std::format("{:%Y-%m-%d %H:%M}", now);
-	return  "<hr><footer> Report generated at <time>" + time_string + "</time> </footer>";
+	out.raw("<hr><footer> Report generated at <time>").timestamp(now).raw("</time> </footer>");
 }
 
-std::string resources_gacha(dcon::user_id user) {
+static void account_pending(html_writer& out) {
+	out.raw("<html><head><title>Please wait</title><meta http-equiv=\"refresh\" content=\"1\"></head><body>Your account will be ready after the next update of the world.</body></html>");
+}
+
+void resources_gacha(html_writer& out, dcon::user_id user) {
 	if(!user) {
-		return "<html><head><title>Error</title></head><body>Invalid credentials</body></html>";
+		out.raw("<html><head><title>Error</title></head><body>Invalid credentials</body></html>");
+		return;
+	}
+	auto view = acquire_view();
+	if (!view_has_user(*view, user)) {
+		account_pending(out);
+		return;
 	}
 
-	std::string result = "<html><head><title>RGO Acquisition</title></head><body>";
+	out.raw("<html><head><title>RGO Acquisition</title></head><body>");
 
-	result += "<a href="+ url_gen::main_mage() +">Back to the main page</a>";
+	out.raw("<a href=").url(url_path::main_page).raw(">Back to the main page</a>");
 
-	result += "<h1>Acquisition of Resource Gathering Operations</h1>";
+	out.raw("<h1>Acquisition of Resource Gathering Operations</h1>");
 
-	result += "<h2>Explanation</h2>In this world RGO lottery is the main way to distribute rights to exploit resources. Everyone who have managed to obtain Development Tickets is eligible to participate in the lottery.";
+	out.raw("<h2>Explanation</h2>In this world RGO lottery is the main way to distribute rights to exploit resources. Everyone who have managed to obtain Development Tickets is eligible to participate in the lottery.");
 
-	result += "<h2>Tickets</h2>You possess " + std::to_string(pulls_count(user)) + " Development Tickets. Each draw requires at least 1 ticket.";
+	out.raw("<h2>Tickets</h2>You possess ").integer(pulls_count(*view, user)).raw(" Development Tickets. Each draw requires at least 1 ticket.");
 
-	result += "<h2>Draw</h2>";
+	out.raw("<h2>Draw</h2>");
 
-	result += "<form action=\"" + url_gen::one_pull() + "\" method=\"post\"><button type=\"submit\">One draw</button></form>";
-	result += "<form action=\"" + url_gen::ten_pull() + "\" method=\"post\"><button type=\"submit\">Ten draws</button></form>";
+	out.raw("<form action=\"").url(url_path::one_pull).raw("\" method=\"post\"><button type=\"submit\">One draw</button></form>");
+	out.raw("<form action=\"").url(url_path::ten_pull).raw("\" method=\"post\"><button type=\"submit\">Ten draws</button></form>");
 
-	result += footer();
+	footer(out);
 
-	result += "</body></html>";
-	return result;
+	out.raw("</body></html>");
 }
 
-std::string make_report(dcon::user_id user) {
+void make_report(html_writer& out, dcon::user_id user) {
 	if(!user) {
-		return "<html><head><title>Error</title></head><body>Invalid credentials</body></html>";
+		out.raw("<html><head><title>Error</title></head><body>Invalid credentials</body></html>");
+		return;
+	}
+	auto view = acquire_view();
+	if (!view_has_user(*view, user)) {
+		account_pending(out);
+		return;
 	}
-	return std::format(
-		"<html><head><title>Control panel</title></head><body><h1>Welcome, {}</h1> {}<h2>Available building types</h2>{}{}{}</body></html>",
-		retrieve_user_name(user),
-		retrieve_user_report_body(user),
-		retrieve_building_type_list(),
-		trade_section(user),
-		footer()
-	);
+	out.raw("<html><head><title>Control panel</title></head><body><h1>Welcome, ");
+	retrieve_user_name(out, *view, user);
+	out.raw("</h1> ");
+	retrieve_user_report_body(out, *view, user);
+	out.raw("<h2>Available building types</h2>");
+	retrieve_building_type_list(out, *view);
+	trade_section(out, *view, user);
+	footer(out);
+	out.raw("</body></html>");
 }
 
-std::string login_page() {
-	return "<html><head><title>Consent required.</title></head><body>We have to store your data to link your session cookie with in-game entity. We use data only for the in-game purposes. If you agree, pressing the  login button will generate a cookie and will allow you to interact with the game.<form action=\"" + url_gen::new_user() +"\" method=\"post\"><label for=\"name\">Username:</label><input type=\"text\" name=\"name\" required /><label for=\"password\">Password</label><input type=\"password\" name=\"password\" required /><input type=\"submit\" value=\"Sign in\"/></form></body></html>";
+void login_page(html_writer& out) {
+	out.raw("<html><head><title>Consent required.</title></head><body>We have to store your data to link your session cookie with in-game entity. We use data only for the in-game purposes. If you agree, pressing the  login button will generate a cookie and will allow you to interact with the game.<form action=\"");
+	out.url(url_path::new_user);
+	out.raw("\" method=\"post\"><label for=\"name\">Username:</label><input type=\"text\" name=\"name\" required /><label for=\"password\">Password</label><input type=\"password\" name=\"password\" required /><input type=\"submit\" value=\"Sign in\"/></form></body></html>");
 }
\ No newline at end of file
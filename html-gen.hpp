@@ -2,6 +2,8 @@
 #include <string>
 #include "data_ids.hpp"
 
-std::string make_report(dcon::user_id user);
-std::string login_page();
-std::string resources_gacha(dcon::user_id user) ;
\ No newline at end of file
+struct html_writer;
+
+void make_report(html_writer& out, dcon::user_id user);
+void login_page(html_writer& out);
+void resources_gacha(html_writer& out, dcon::user_id user) ;
\ No newline at end of file
@@ -0,0 +1,196 @@
+#include "html_writer.hpp"
+#include <charconv>
+#include <format>
+#include <mutex>
+#include "url.hpp"
+
+void html_writer::clear() {
+	for (size_t i = 0; i <= active && i < chunks.size(); i++) {
+		chunks[i].clear();
+	}
+	active = 0;
+	splices.clear();
+}
+
+html_writer& html_writer::raw(std::string_view value) {
+	while (!value.empty()) {
+		if (active == chunks.size()) {
+			chunks.emplace_back();
+			chunks.back().reserve(page_chunk_size);
+		}
+		auto& chunk = chunks[active];
+		auto space = page_chunk_size - chunk.size();
+		if (space == 0) {
+			active++;
+			continue;
+		}
+		auto taken = std::min(space, value.size());
+		chunk.append(value.substr(0, taken));
+		value.remove_prefix(taken);
+	}
+	return *this;
+}
+
+html_writer& html_writer::splice(shared_fragment fragment) {
+	auto offset = active < chunks.size() ? chunks[active].size() : 0;
+	splices.push_back({active, offset, std::move(fragment)});
+	return *this;
+}
+
+html_writer& html_writer::text(std::string_view value) {
+	size_t start = 0;
+	for (size_t i = 0; i < value.size(); i++) {
+		std::string_view replacement;
+		switch (value[i]) {
+		case '&': replacement = "&amp;"; break;
+		case '<': replacement = "&lt;"; break;
+		case '>': replacement = "&gt;"; break;
+		case '"': replacement = "&quot;"; break;
+		case '\'': replacement = "&#39;"; break;
+		default: continue;
+		}
+		raw(value.substr(start, i - start));
+		raw(replacement);
+		start = i + 1;
+	}
+	return raw(value.substr(start));
+}
+
+html_writer& html_writer::integer(int64_t value) {
+	char digits[24];
+	auto result = std::to_chars(digits, digits + sizeof(digits), value);
+	return raw({digits, result.ptr});
+}
+
+html_writer& html_writer::number(__uint128_t value) {
+	// 2^128 has 39 decimal digits
+	char digits[40];
+	char* position = digits + sizeof(digits);
+	do {
+		*--position = (char)('0' + (uint8_t)(value % 10));
+		value /= 10;
+	} while (value != 0);
+	return raw({position, digits + sizeof(digits)});
+}
+
+html_writer& html_writer::timestamp(std::chrono::system_clock::time_point time) {
+	char formatted[32];
+	auto result = std::format_to_n(formatted, sizeof(formatted), "{:%Y-%m-%d %H:%M}", time);
+	return raw({formatted, result.out});
+}
+
+html_writer& html_writer::url(std::string_view path) {
+	raw(url_gen::base_prefix());
+	return raw(path);
+}
+
+html_writer& html_writer::url(std::string_view path, int64_t id) {
+	url(path);
+	raw("?id=");
+	return integer(id);
+}
+
+size_t html_writer::size() const {
+	size_t result = 0;
+	for (size_t i = 0; i <= active && i < chunks.size(); i++) {
+		result += chunks[i].size();
+	}
+	for (auto& point : splices) {
+		result += point.fragment->size();
+	}
+	return result;
+}
+
+void html_writer::segments(std::vector<page_segment>& result) const {
+	auto add = [&](char const* data, size_t size) {
+		if (size > 0) result.push_back({data, size});
+	};
+	size_t next = 0;
+	for (size_t i = 0; i <= active; i++) {
+		char const* data = i < chunks.size() ? chunks[i].data() : nullptr;
+		size_t length = i < chunks.size() ? chunks[i].size() : 0;
+		size_t start = 0;
+		while (next < splices.size() && splices[next].chunk == i) {
+			auto& point = splices[next];
+			add(data + start, point.offset - start);
+			add(point.fragment->data(), point.fragment->size());
+			start = point.offset;
+			next++;
+		}
+		add(data + start, length - start);
+	}
+}
+
+std::string html_writer::str() const {
+	std::vector<page_segment> parts;
+	segments(parts);
+	std::string result;
+	result.reserve(size());
+	for (auto& part : parts) {
+		result.append(part.data, part.size);
+	}
+	return result;
+}
+
+/* POOL */
+
+// writers beyond these limits are freed instead of kept around
+static constexpr size_t pooled_writers = 256;
+static constexpr size_t pooled_chunks = 16;
+// every thread renders into its own few writers first and only touches the shared pool past them
+static constexpr size_t thread_cached_writers = 8;
+
+static std::mutex pool_mutex;
+static std::vector<html_writer*> pool;
+
+static void return_to_pool(html_writer* writer) {
+	{
+		std::lock_guard<std::mutex> lock {pool_mutex};
+		if (pool.size() < pooled_writers) {
+			pool.push_back(writer);
+			return;
+		}
+	}
+	delete writer;
+}
+
+struct thread_writer_cache {
+	html_writer* writers[thread_cached_writers];
+	size_t count = 0;
+
+	~thread_writer_cache() {
+		while (count > 0) {
+			return_to_pool(writers[--count]);
+		}
+	}
+};
+
+static thread_local thread_writer_cache local_writers;
+
+html_writer* acquire_page_writer() {
+	if (local_writers.count > 0) {
+		return local_writers.writers[--local_writers.count];
+	}
+	{
+		std::lock_guard<std::mutex> lock {pool_mutex};
+		if (!pool.empty()) {
+			auto writer = pool.back();
+			pool.pop_back();
+			return writer;
+		}
+	}
+	return new html_writer;
+}
+
+void release_page_writer(html_writer* writer) {
+	if (!writer) return;
+	writer->clear();
+	if (writer->chunks.size() > pooled_chunks) {
+		writer->chunks.resize(pooled_chunks);
+	}
+	if (local_writers.count < thread_cached_writers) {
+		local_writers.writers[local_writers.count++] = writer;
+		return;
+	}
+	return_to_pool(writer);
+}
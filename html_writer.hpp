@@ -0,0 +1,78 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/*
+
+Pages are appended straight into fixed size chunks instead of being glued from temporaries.
+Markup goes through raw(), anything which comes from the world or from users goes through text().
+
+Chunks never reallocate, so growing a page doesn't copy what was already written,
+and the finished page is handed to MHD as is: one buffer or a scatter/gather list of chunks.
+Writers are pooled and come back with their chunks once MHD has sent the page,
+each thread keeps a few of its own so concurrent renders don't meet on the pool lock.
+Prerendered fragments are spliced in by reference and become segments of their own.
+
+*/
+
+constexpr size_t page_chunk_size = 10 * 1024;
+
+struct page_segment {
+	char const* data;
+	size_t size;
+};
+
+using shared_fragment = std::shared_ptr<std::string const>;
+
+struct html_writer {
+	struct splice_point {
+		size_t chunk;
+		size_t offset;
+		shared_fragment fragment;
+	};
+
+	// every chunk is reserved to page_chunk_size and never grows past it
+	std::vector<std::string> chunks;
+	size_t active = 0;
+	// ordered by position, the writer keeps the fragments alive until it is cleared
+	std::vector<splice_point> splices;
+
+	void clear();
+
+	html_writer& raw(std::string_view value);
+	html_writer& splice(shared_fragment fragment);
+	// escapes characters which would break markup or attribute values
+	html_writer& text(std::string_view value);
+	html_writer& integer(int64_t value);
+	html_writer& number(__uint128_t value);
+	html_writer& timestamp(std::chrono::system_clock::time_point time);
+	// base prefix followed by the path
+	html_writer& url(std::string_view path);
+	// base prefix followed by the path and ?id=
+	html_writer& url(std::string_view path, int64_t id);
+
+	size_t size() const;
+	// written chunks and spliced fragments in order, empty ones skipped
+	void segments(std::vector<page_segment>& result) const;
+	// contiguous copy, for callers which need one string
+	std::string str() const;
+};
+
+html_writer* acquire_page_writer();
+// called by the response once MHD is done with the page
+void release_page_writer(html_writer* writer);
+
+struct page_writer_release {
+	void operator()(html_writer* writer) const {
+		release_page_writer(writer);
+	}
+};
+using page_writer_ptr = std::unique_ptr<html_writer, page_writer_release>;
+
+inline page_writer_ptr make_page_writer() {
+	return page_writer_ptr {acquire_page_writer()};
+}
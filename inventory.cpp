@@ -0,0 +1,184 @@
+#include "inventory.hpp"
+#include <algorithm>
+#include <cstring>
+
+inventory_table::inventory_table(inventory_table const& other) {
+	*this = other;
+}
+
+inventory_table& inventory_table::operator=(inventory_table const& other) {
+	if (this == &other) return *this;
+	if (commodity_count != other.commodity_count) {
+		rows.clear();
+	}
+	layout = other.layout;
+	columns = other.columns;
+	stride = other.stride;
+	storage_count = other.storage_count;
+	commodity_count = other.commodity_count;
+	slots = other.slots;
+	rows_used = 0;
+	for (auto& s : slots) {
+		if (!s.dense) continue;
+		auto row = allocate_row();
+		memcpy(row, s.dense, commodity_count * sizeof(int32_t));
+		s.dense = row;
+	}
+	return *this;
+}
+
+void inventory_table::set_layout(inventory_layout value) {
+	clear();
+	layout = value;
+}
+
+void inventory_table::resize_columns(uint32_t storages, uint32_t commodities) {
+	storages = std::max(storages, storage_count);
+	commodities = std::max(commodities, commodity_count);
+	if (storages <= stride && commodities <= commodity_count) {
+		storage_count = storages;
+		return;
+	}
+	// storages are created one by one, the capacity grows ahead of them
+	auto grown_stride = storages <= stride ? stride : std::max(storages, stride + stride / 2);
+	std::vector<int32_t> grown(size_t(commodities) * grown_stride, 0);
+	for (uint32_t c = 0; c < commodity_count; c++) {
+		std::copy_n(columns.data() + size_t(c) * stride, storage_count, grown.data() + size_t(c) * grown_stride);
+	}
+	columns = std::move(grown);
+	stride = grown_stride;
+	storage_count = storages;
+	commodity_count = commodities;
+}
+
+void inventory_table::resize(uint32_t storages, uint32_t commodities) {
+	if (layout == inventory_layout::dense) {
+		resize_columns(storages, commodities);
+		return;
+	}
+	if (commodities > commodity_count) {
+		// dense rows have to cover every commodity
+		std::vector<std::unique_ptr<int32_t[]>> grown;
+		for (auto& s : slots) {
+			if (!s.dense) continue;
+			auto row = std::make_unique<int32_t[]>(commodities);
+			memcpy(row.get(), s.dense, commodity_count * sizeof(int32_t));
+			s.dense = row.get();
+			grown.push_back(std::move(row));
+		}
+		rows = std::move(grown);
+		rows_used = rows.size();
+		commodity_count = commodities;
+	}
+	if (storages > slots.size()) {
+		slots.resize(storages);
+	}
+}
+
+void inventory_table::clear() {
+	columns.clear();
+	stride = 0;
+	storage_count = 0;
+	slots.clear();
+	rows_used = 0;
+}
+
+int32_t inventory_table::get(dcon::storage_id storage, dcon::commodity_id cid) const {
+	// invalid ids hold nothing
+	if (storage.index() < 0 || cid.index() < 0) return 0;
+	auto raw = size_t(storage.index());
+	if (layout == inventory_layout::dense) {
+		if (raw >= storage_count) return 0;
+		return columns[size_t(cid.index()) * stride + raw];
+	}
+	if (raw >= slots.size()) return 0;
+	auto const& s = slots[raw];
+	if (s.dense) return s.dense[cid.index()];
+	for (uint32_t i = 0; i < s.count; i++) {
+		if (s.commodity[i] == cid.index()) return s.amount[i];
+	}
+	return 0;
+}
+
+void inventory_table::set(dcon::storage_id storage, dcon::commodity_id cid, int32_t value) {
+	// invalid ids can't hold anything
+	if (storage.index() < 0 || cid.index() < 0) return;
+	auto raw = size_t(storage.index());
+	if (layout == inventory_layout::dense) {
+		if (raw >= storage_count) {
+			if (value == 0) return;
+			resize_columns(uint32_t(raw + 1), commodity_count);
+		}
+		columns[size_t(cid.index()) * stride + raw] = value;
+		return;
+	}
+	if (raw >= slots.size()) {
+		if (value == 0) return;
+		slots.resize(raw + 1);
+	}
+	auto& s = slots[raw];
+	if (s.dense) {
+		s.dense[cid.index()] = value;
+		return;
+	}
+
+	auto commodity = commodity_index(cid.index());
+	uint32_t i = 0;
+	while (i < s.count && s.commodity[i] < commodity) i++;
+
+	if (i < s.count && s.commodity[i] == commodity) {
+		if (value != 0) {
+			s.amount[i] = value;
+			return;
+		}
+		// zero amounts are not kept
+		for (; i + 1 < s.count; i++) {
+			s.commodity[i] = s.commodity[i + 1];
+			s.amount[i] = s.amount[i + 1];
+		}
+		s.count--;
+		return;
+	}
+	if (value == 0) return;
+
+	if (s.count == small_inventory_size) {
+		make_dense(s);
+		s.dense[commodity] = value;
+		return;
+	}
+	for (auto j = s.count; j > i; j--) {
+		s.commodity[j] = s.commodity[j - 1];
+		s.amount[j] = s.amount[j - 1];
+	}
+	s.commodity[i] = commodity;
+	s.amount[i] = value;
+	s.count++;
+}
+
+int32_t* inventory_table::allocate_row() {
+	std::lock_guard<std::mutex> lock {rows_mutex};
+	if (rows_used == rows.size()) {
+		rows.push_back(std::make_unique<int32_t[]>(commodity_count));
+	}
+	return rows[rows_used++].get();
+}
+
+void inventory_table::make_dense(slot& s) {
+	auto row = allocate_row();
+	std::fill(row, row + commodity_count, 0);
+	for (uint32_t i = 0; i < s.count; i++) {
+		row[s.commodity[i]] = s.amount[i];
+	}
+	s.count = 0;
+	s.dense = row;
+}
+
+size_t inventory_table::dense_storages() const {
+	return layout == inventory_layout::dense ? storage_count : rows_used;
+}
+
+size_t inventory_table::memory_bytes() const {
+	return columns.capacity() * sizeof(int32_t)
+		+ slots.capacity() * sizeof(slot)
+		+ rows.size() * commodity_count * sizeof(int32_t);
+}
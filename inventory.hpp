@@ -0,0 +1,115 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "data_ids.hpp"
+
+/*
+
+Stockpiles of storages in one of two layouts.
+The dense layout keeps a column per commodity over every storage, like the container did,
+so production can gather a commodity for a whole vector of storages at once.
+The sparse layout is for worlds with many commodities, where most storages hold one or two of them:
+a storage starts as a small map of non-zero amounts sorted by commodity,
+once it holds more than small_inventory_size commodities it switches to a dense row over all of them,
+which is what hubs like personal storages end up with.
+Memory then follows what storages actually hold instead of storages × commodities.
+
+*/
+
+constexpr uint32_t small_inventory_size = 4;
+
+enum class inventory_layout {
+	dense, sparse
+};
+
+struct inventory_table {
+	using commodity_index = dcon::commodity_id::value_base_t;
+
+	struct slot {
+		// row over every commodity once the storage became dense
+		int32_t* dense = nullptr;
+		uint32_t count = 0;
+		commodity_index commodity[small_inventory_size];
+		int32_t amount[small_inventory_size];
+	};
+
+	inventory_table() = default;
+	// deep copy, rows of the copy reuse rows this table already allocated
+	inventory_table(inventory_table const& other);
+	inventory_table& operator=(inventory_table const& other);
+
+	// Not thread safe: drops every amount.
+	void set_layout(inventory_layout value);
+	inventory_layout get_layout() const { return layout; }
+
+	// Not thread safe. Afterwards storages below the size may be changed from many threads at once,
+	// as long as every storage is changed by one thread only.
+	void resize(uint32_t storages, uint32_t commodities);
+	void clear();
+
+	// dense layout only: amounts of the commodity indexed by storage, valid until the table grows
+	int32_t* column(dcon::commodity_id cid) {
+		return columns.data() + size_t(cid.index()) * stride;
+	}
+
+	int32_t get(dcon::storage_id storage, dcon::commodity_id cid) const;
+	// storages beyond the size grow the table, which is not thread safe
+	void set(dcon::storage_id storage, dcon::commodity_id cid, int32_t value);
+	void add(dcon::storage_id storage, dcon::commodity_id cid, int32_t delta) {
+		set(storage, cid, get(storage, cid) + delta);
+	}
+
+	// visits non-zero amounts in commodity order
+	template<typename F>
+	void for_each(dcon::storage_id storage, F&& f) const {
+		if (storage.index() < 0) return;
+		auto raw = size_t(storage.index());
+		if (layout == inventory_layout::dense) {
+			if (raw >= storage_count) return;
+			for (uint32_t i = 0; i < commodity_count; i++) {
+				auto amount = columns[size_t(i) * stride + raw];
+				if (amount != 0) f(dcon::commodity_id {commodity_index(i)}, amount);
+			}
+			return;
+		}
+		if (raw >= slots.size()) return;
+		auto const& s = slots[raw];
+		if (s.dense) {
+			for (uint32_t i = 0; i < commodity_count; i++) {
+				if (s.dense[i] != 0) f(dcon::commodity_id {commodity_index(i)}, s.dense[i]);
+			}
+			return;
+		}
+		for (uint32_t i = 0; i < s.count; i++) {
+			f(dcon::commodity_id {s.commodity[i]}, s.amount[i]);
+		}
+	}
+
+	uint32_t size() const { return layout == inventory_layout::dense ? storage_count : (uint32_t)slots.size(); }
+	size_t dense_storages() const;
+	size_t memory_bytes() const;
+
+private:
+	inventory_layout layout = inventory_layout::dense;
+	uint32_t commodity_count = 0;
+
+	// dense layout: commodity major, stride is the capacity in storages
+	std::vector<int32_t> columns;
+	uint32_t stride = 0;
+	uint32_t storage_count = 0;
+
+	// sparse layout
+	std::vector<slot> slots;
+
+	// rows are never freed while the table lives, a copy reuses the ones it has
+	std::mutex rows_mutex;
+	std::vector<std::unique_ptr<int32_t[]>> rows;
+	size_t rows_used = 0;
+
+	int32_t* allocate_row();
+	void make_dense(slot& s);
+	void resize_columns(uint32_t storages, uint32_t commodities);
+};
@@ -0,0 +1,69 @@
+#include "job_pool.hpp"
+#include <format>
+
+job_pool::job_pool(const char* name, unsigned workers_count, size_t capacity) : name(name), capacity(capacity) {
+	for (unsigned i = 0; i < workers_count; i++) {
+		workers.emplace_back([this]() { run(); });
+	}
+}
+
+job_pool::~job_pool() {
+	stop();
+}
+
+bool job_pool::submit(std::function<void()> job) {
+	{
+		std::lock_guard<std::mutex> lock {mtx};
+		if (stopping || jobs.size() >= capacity) {
+			rejected.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+		jobs.push_back(std::move(job));
+	}
+	wake.notify_one();
+	return true;
+}
+
+void job_pool::stop() {
+	{
+		std::lock_guard<std::mutex> lock {mtx};
+		stopping = true;
+	}
+	wake.notify_all();
+	for (auto& worker : workers) {
+		if (worker.joinable()) worker.join();
+	}
+}
+
+size_t job_pool::depth() {
+	std::lock_guard<std::mutex> lock {mtx};
+	return jobs.size();
+}
+
+void job_pool::write_metrics(std::string& result) {
+	result += "# TYPE job_pool_depth gauge\n";
+	result += std::format("job_pool_depth{{pool=\"{}\"}} {}\n", name, depth());
+	result += "# TYPE job_pool_capacity gauge\n";
+	result += std::format("job_pool_capacity{{pool=\"{}\"}} {}\n", name, capacity);
+	result += "# TYPE job_pool_workers gauge\n";
+	result += std::format("job_pool_workers{{pool=\"{}\"}} {}\n", name, workers.size());
+	result += "# TYPE job_pool_completed_total counter\n";
+	result += std::format("job_pool_completed_total{{pool=\"{}\"}} {}\n", name, completed.load(std::memory_order_relaxed));
+	result += "# TYPE job_pool_rejected_total counter\n";
+	result += std::format("job_pool_rejected_total{{pool=\"{}\"}} {}\n", name, rejected.load(std::memory_order_relaxed));
+}
+
+void job_pool::run() {
+	while (true) {
+		std::function<void()> job;
+		{
+			std::unique_lock<std::mutex> lock {mtx};
+			wake.wait(lock, [&]() { return stopping || !jobs.empty(); });
+			if (jobs.empty()) return;
+			job = std::move(jobs.front());
+			jobs.pop_front();
+		}
+		job();
+		completed.fetch_add(1, std::memory_order_relaxed);
+	}
+}
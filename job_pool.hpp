@@ -0,0 +1,46 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+
+Fixed set of worker threads with a bounded backlog.
+Used for jobs which are too heavy for the HTTP thread, like password hashing.
+
+*/
+
+struct job_pool {
+	const char* name;
+	size_t capacity;
+
+	std::atomic<uint64_t> completed {0};
+	std::atomic<uint64_t> rejected {0};
+
+	job_pool(const char* name, unsigned workers, size_t capacity);
+	~job_pool();
+
+	// returns false without running the job when the backlog is full
+	bool submit(std::function<void()> job);
+	// finishes queued jobs and joins the workers
+	void stop();
+
+	size_t depth();
+	void write_metrics(std::string& result);
+
+private:
+	std::mutex mtx;
+	std::condition_variable wake;
+	std::deque<std::function<void()>> jobs;
+	std::vector<std::thread> workers;
+	bool stopping = false;
+
+	void run();
+};
@@ -0,0 +1,70 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+#include "request_log.hpp"
+
+/*
+
+Prints a binary request log as one line per entry.
+
+	./log_dump requests.binlog
+
+*/
+
+static const char* level_names[] = {"debug", "info", "warning", "error"};
+static const char* event_names[] = {"request", "header"};
+static const char* method_names[] = {"-", "GET", "POST"};
+
+template<typename T, size_t N>
+static const char* name_of(const char* const (&names)[N], T value) {
+	auto index = (size_t)value;
+	return index < N ? names[index] : "?";
+}
+
+int main(int argc, char** argv) {
+	if (argc < 2) {
+		printf("usage: %s requests.binlog\n", argv[0]);
+		return 1;
+	}
+	FILE* file = fopen(argv[1], "rb");
+	if (!file) {
+		printf("Failed to open %s\n", argv[1]);
+		return 1;
+	}
+	char magic[sizeof(request_log_magic)];
+	if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) || memcmp(magic, request_log_magic, sizeof(magic)) != 0) {
+		printf("%s is not a request log\n", argv[1]);
+		fclose(file);
+		return 1;
+	}
+
+	request_log_entry entry;
+	while (fread(&entry, 1, request_log_entry_header_size, file) == request_log_entry_header_size) {
+		if (fread(entry.text, 1, entry.text_size, file) != entry.text_size) break;
+
+		time_t seconds = entry.time / 1000000000;
+		tm utc;
+		gmtime_r(&seconds, &utc);
+		char date[32];
+		strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &utc);
+
+		printf(
+			"%s.%06lld %s t%u %s %s %.*s user %d code %u %u us\n",
+			date,
+			(long long)(entry.time % 1000000000 / 1000),
+			name_of(level_names, entry.level),
+			(unsigned)entry.thread,
+			name_of(event_names, entry.event),
+			name_of(method_names, entry.method),
+			(int)entry.text_size,
+			entry.text,
+			entry.user,
+			(unsigned)entry.code,
+			entry.duration_us
+		);
+	}
+	fclose(file);
+	return 0;
+}
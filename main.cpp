@@ -6,11 +6,14 @@
 #include <stdio.h>
 
 #include <string>
+#include <algorithm>
 #include <chrono>
 #include <fstream>
+#include <memory>
 #include <thread>
 
 #include "argon2.h"
+#include "command_ticket.hpp"
 
 #include "data_ids.hpp"
 #include "simulation.hpp"
@@ -19,6 +22,13 @@
 #include "unordered_dense.h"
 #include "routing.hpp"
 #include "html-gen.hpp"
+#include "html_writer.hpp"
+#include "session.hpp"
+#include "job_pool.hpp"
+#include "metrics.hpp"
+#include "page_cache.hpp"
+#include "request_log.hpp"
+#include "tick_scheduler.hpp"
 #include "url.hpp"
 
 
@@ -32,21 +42,26 @@ int64_t b10_to_int(std::string in_value) {
 	return result;
 }
 
-struct common_params {
-	int32_t id;
-};
+int64_t read_setting(const char* name, int64_t fallback) {
+	const char* value = getenv(name);
+	if (!value) return fallback;
+	return b10_to_int(value);
+}
+
+const char* read_text_setting(const char* name, const char* fallback) {
+	const char* value = getenv(name);
+	if (!value) return fallback;
+	return value;
+}
 
-MHD_Result parse_common_key_value_pairs (
+// header values can carry session cookies, so only the names are logged
+static MHD_Result log_header_name (
 	void *cls,
 	enum MHD_ValueKind kind,
 	const char *key,
 	const char *value
 ) {
-	common_params * data = (common_params *) cls;
-	if (0 == strcmp(key, "id")) {
-		data->id = b10_to_int(value);
-	}
-	printf ("%s: %s\n", key, value);
+	log_request_event(log_level::debug, request_event::header, key);
 	return MHD_YES;
 }
 
@@ -76,6 +91,14 @@ iterate_post_action (
 		con_info->id2 = b10_to_int(data);
 	}
 
+	if (0 == strcmp(key, "id3")) {
+		con_info->id3 = b10_to_int(data);
+	}
+
+	if (0 == strcmp(key, "cid")) {
+		con_info->cid = b10_to_int(data);
+	}
+
 	if (0 == strcmp(key, "volume")) {
 		con_info->volume = b10_to_int(data);
 	}
@@ -113,28 +136,63 @@ iterate_post_new_user (
 		}
 	}
 	if (0 == strcmp(key, "password")) {
-		uint32_t t_cost = 2;
-		uint32_t m_cost = (1<<16);
-		uint32_t parallelism = 1;
-		argon2i_hash_raw(
-			t_cost,
-			m_cost,
-			parallelism,
-			data,
-			strlen(data),
-			salt,
-			SALTLEN,
-			con_info->password_hash,
-			HASHLEN
-		);
+		if (off == 0) con_info->password.clear();
+		con_info->password.append(data, size);
 		con_info->password_flag = true;
 	}
 
-	if (con_info->name_flag && con_info->password_flag) {
-		con_info->user = create_or_get_user(con_info->name, con_info->password_hash);
-		con_info->answerstring = make_report(con_info->user);
+	return MHD_YES;
+}
+
+/*
+
+Password hashing takes tens of milliseconds and 64 MiB per job,
+so logins are suspended and hashed on a separate bounded pool.
+
+*/
+
+#define LOGIN_JOB_MEMORY_MB 64
+
+static std::unique_ptr<job_pool> login_pool;
+
+static void hash_login(struct MHD_Connection * connection, connection_info_struct * con_info) {
+	uint32_t t_cost = 2;
+	uint32_t m_cost = (1<<16);
+	uint32_t parallelism = 1;
+	argon2i_hash_raw(
+		t_cost,
+		m_cost,
+		parallelism,
+		con_info->password.data(),
+		con_info->password.size(),
+		salt,
+		SALTLEN,
+		con_info->password_hash,
+		HASHLEN
+	);
+	std::fill(con_info->password.begin(), con_info->password.end(), 0);
+	con_info->password.clear();
+
+	con_info->user = create_or_get_user(con_info->name, con_info->password_hash);
+	if (con_info->user) {
+		con_info->answer = make_page_writer();
+		make_report(*con_info->answer, con_info->user);
 	}
+	con_info->login.store(login_state::done, std::memory_order_release);
+	MHD_resume_connection(connection);
+}
 
+static MHD_Result start_login(struct MHD_Connection * connection, connection_info_struct * con_info) {
+	con_info->login.store(login_state::hashing, std::memory_order_relaxed);
+	// suspend first: a fast worker could otherwise resume a connection which is not suspended yet
+	MHD_suspend_connection(connection);
+	auto submitted = login_pool->submit([connection, con_info]() {
+		hash_login(connection, con_info);
+	});
+	if (!submitted) {
+		con_info->login.store(login_state::rejected, std::memory_order_release);
+		MHD_resume_connection(connection);
+	}
 	return MHD_YES;
 }
 
@@ -147,9 +205,24 @@ request_completed (
 	struct connection_info_struct *con_info = (connection_info_struct*) *req_cls;
 	if (NULL == con_info) return;
 
+	auto level = toe == MHD_REQUEST_TERMINATED_COMPLETED_OK ? log_level::info : log_level::warning;
+	if (request_log_enabled(level)) {
+		auto duration = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - con_info->started);
+		log_request_event(
+			level,
+			request_event::request,
+			con_info->matched_route ? con_info->matched_route->path : std::string_view {"unrouted"},
+			con_info->user ? (int32_t)con_info->user.index() : -1,
+			con_info->connectiontype == connection_type::post ? log_method_post : log_method_get,
+			(uint8_t)toe,
+			(uint32_t)std::min<int64_t>(duration.count(), UINT32_MAX)
+		);
+	}
+
 	if (con_info->connectiontype == connection_type::post) {
 		MHD_destroy_post_processor (con_info->postprocessor);
 	}
+	close_ticket(con_info->ticket);
 
 	*req_cls = NULL;
 
@@ -160,35 +233,68 @@ request_completed (
 
 
 
-#define SESSIONSIZE 64
+static session_store sessions;
+
+static MHD_Result POST_login(
+	struct MHD_Connection * connection,
+	connection_info_struct * con_info
+) {
+	struct MHD_Response *response;
+	enum MHD_Result ret;
 
-static std::mutex session_mutex{};
-static ankerl::unordered_dense::map<std::string, dcon::user_id> session_to_user;
-static ankerl::unordered_dense::map<int32_t, std::string> user_to_session;
+	auto state = con_info->login.load(std::memory_order_acquire);
+	if (state == login_state::idle) {
+		if (!con_info->name_flag || !con_info->password_flag) {
+			return send_page_from_memory(
+				connection,
+				errorpage.c_str(),
+				MHD_HTTP_BAD_REQUEST
+			);
+		}
+		return start_login(connection, con_info);
+	}
+	if (state == login_state::hashing) {
+		return MHD_YES;
+	}
+	if (state == login_state::rejected) {
+		return reject_request(connection, request_status::queue_full);
+	}
+	if (!con_info->user) {
+		return send_page_from_memory(
+			connection,
+			errorpage.c_str(),
+			MHD_HTTP_BAD_REQUEST
+		);
+	}
 
-std::string generate_session(dcon::user_id uid) {
-	std::random_device r;
-	std::seed_seq seed2{r(), r(), r(), r(), r(), r(), r(), r()};
-	std::mt19937 engine(seed2);
-	std::uniform_int_distribution<> dist(
-		0, 25
+	auto session = sessions.create(con_info->user);
+	char key_value[SESSIONSIZE+48];
+	snprintf(
+		key_value, sizeof(key_value),
+		"%s=%s; Max-Age=%lld",
+		"SESSION",
+		session.c_str(),
+		(long long)sessions.time_to_live.count()
 	);
+	response = make_page_response(std::move(con_info->answer));
 
-	std::string session_string {};
-	for(int i = 0; i < SESSIONSIZE; i++) {
-		session_string += ('A' + dist(engine));
+	if (!response) {
+		return MHD_NO;
 	}
 
-	session_mutex.lock();
-	auto it = user_to_session.find(uid.index());
-	if (it == user_to_session.end()) {
-		session_to_user.erase(it->second);
-	}
-	session_to_user[session_string] = uid;
-	user_to_session[uid.index()] = session_string;
-	session_mutex.unlock();
+	MHD_add_response_header(
+		response,
+		MHD_HTTP_HEADER_SET_COOKIE,
+		key_value
+	);
 
-	return session_string;
+	ret = MHD_queue_response(
+		connection,
+		MHD_HTTP_OK,
+		response
+	);
+	MHD_destroy_response(response);
+	return ret;
 }
 
 static enum MHD_Result
@@ -206,32 +312,39 @@ ahc_echo(
 	if (NULL == *req_cls) {
 		// set up connection info
 		auto con_info = new connection_info_struct;
+		con_info->started = std::chrono::steady_clock::now();
+		auto path = url_gen::local_path(url);
 
 		if (0 == strcmp (method, "POST")) {
-			if (strcmp(url, url_gen::new_user().c_str()) == 0) {
-				con_info->postprocessor = MHD_create_post_processor (
-					connection,
-					POSTBUFFERSIZE,
-					iterate_post_new_user,
-					(void*) con_info
-				);
-			} else {
-				con_info->postprocessor = MHD_create_post_processor (
-					connection,
-					POSTBUFFERSIZE,
-					iterate_post_action,
-					(void*) con_info
-				);
+			if (path) {
+				con_info->matched_route = find_route(http_method::post, *path);
+			}
+			auto iterator = iterate_post_action;
+			if (con_info->matched_route && con_info->matched_route->post_iterator) {
+				iterator = con_info->matched_route->post_iterator;
 			}
+			con_info->postprocessor = MHD_create_post_processor (
+				connection,
+				POSTBUFFERSIZE,
+				iterator,
+				(void*) con_info
+			);
 			if (NULL == con_info->postprocessor) {
 				delete con_info;
 				return MHD_NO;
 			}
 			con_info->connectiontype = connection_type::post;
 		} else if (0 == strcmp (method, "GET")) {
+			if (path) {
+				con_info->matched_route = find_route(http_method::get, *path);
+			}
 			con_info->connectiontype = connection_type::get;
 		}
 
+		if (request_log_enabled(log_level::debug)) {
+			MHD_get_connection_values(connection, MHD_HEADER_KIND, &log_header_name, NULL);
+		}
+
 		*req_cls = (void*) con_info;
 		return MHD_YES;
 	}
@@ -245,73 +358,26 @@ ahc_echo(
 		"SESSION"
 	);
 
-	printf("session detected\n");
-	printf("%s", detected_session);
-
 	if (detected_session) {
-		std::string session_string = detected_session;
-		auto iterator = session_to_user.find(session_string);
-		if (iterator != session_to_user.end()){
-			con_info->user = iterator->second;
+		auto user = sessions.find(detected_session);
+		if (user) {
+			con_info->user = user;
 		}
 	}
 
 	struct MHD_Response *response;
 	enum MHD_Result ret;
 
-	printf ("New %s request for %s using version %s\n", method, url, version);
 	bool is_post = 0 == strcmp(method, "POST");
 	bool is_get = 0 == strcmp(method, "GET");
 
-	common_params common_keys{};
-
-	const char * user_index = MHD_lookup_connection_value(
-		connection,
-		MHD_GET_ARGUMENT_KIND,
-		"id"
-	);
-	if (user_index) {
-		common_keys.id = b10_to_int(user_index);
-	} else {
-		common_keys.id = 0;
-	}
-
-	// MHD_get_connection_values (
-	// 	connection,
-	// 	MHD_HEADER_KIND,
-	// 	&parse_common_key_value_pairs,
-	// 	&common_keys
-	// );
-
 	if (is_get) {
 		if (0 != *upload_data_size)
 			return MHD_NO; /* upload data in a GET!? */
-		if (con_info->user) {
-			if (0 == strcmp(url, url_gen::building_type().c_str())) {
-				return send_building_type_page(connection, con_info->current_page, common_keys.id);
-			}
-			if (0 == strcmp(url, url_gen::building().c_str())) {
-				return send_building_page(connection, con_info->current_page, common_keys.id);
-			}
-			if (0 == strcmp(url, url_gen::gacha_page().c_str())) {
-				return send_gacha_page(connection, con_info->current_page, con_info->user);
-			}
-			return send_main_page(connection, con_info->current_page, con_info->user);
-		} else {
-			auto page = login_page();
-			response = MHD_create_response_from_buffer (
-				strlen(page.c_str()),
-				(void*) page.c_str(),
-				MHD_RESPMEM_MUST_COPY
-			);
-			ret = MHD_queue_response(
-				connection,
-				MHD_HTTP_OK,
-				response
-			);
-			MHD_destroy_response(response);
-			return ret;
+		if (!con_info->matched_route) {
+			return GET_main_page(connection, con_info);
 		}
+		return con_info->matched_route->handler(connection, con_info);
 	} else if (is_post) {
 		if (*upload_data_size != 0) {
 			MHD_post_process (
@@ -322,100 +388,10 @@ ahc_echo(
 			*upload_data_size = 0;
 			return MHD_YES;
 		}
-		if (strcmp(url, url_gen::set_transfer().c_str()) == 0) {
-			return POST_request_transfer(connection, con_info);
-		} else if (strcmp(url, url_gen::new_demand().c_str()) == 0) {
-			return POST_request_demand(connection, con_info);
-		} else if (strcmp(url, url_gen::one_pull().c_str()) == 0) {
-			return POST_request_gacha_one(connection, con_info);
-		} else if (strcmp(url, url_gen::ten_pull().c_str()) == 0) {
-			return POST_request_gacha_ten(connection, con_info);
-		} else if (strcmp(url, url_gen::new_building().c_str()) == 0) {
-			if(!con_info->user) {
-				return send_page_from_memory(
-					connection,
-					errorpage.c_str(),
-					MHD_HTTP_UNAUTHORIZED
-				);
-			}
-			auto result = request_new_building(
-				con_info->user,
-				dcon::building_type_id{
-					(dcon::building_type_id::value_base_t)con_info->id
-				}
-			);
-
-			if (!result) {
-				return send_page_from_memory(
-					connection,
-					errorpage.c_str(),
-					MHD_HTTP_INSUFFICIENT_STORAGE
-				);
-			}
-
-			auto page = make_building_type_report(
-			dcon::building_type_id{
-					(dcon::building_type_id::value_base_t)con_info->id
-				}
-			);
-			response = MHD_create_response_from_buffer (
-				strlen(page.c_str()),
-				(void*) page.c_str(),
-				MHD_RESPMEM_MUST_COPY
-			);
-			ret = MHD_queue_response(
-				connection,
-				MHD_HTTP_OK,
-				response
-			);
-			MHD_destroy_response(response);
-			return ret;
-		}
-		if (strcmp(url, url_gen::new_user().c_str()) == 0) {
-			if (con_info->user) {
-				auto session = generate_session(con_info->user);
-				char key_value[SESSIONSIZE+16];
-				snprintf(
-					key_value, sizeof(key_value),
-					"%s=%s",
-					"SESSION",
-					session.c_str()
-				);
-				// printf("new session %s\n", key_value);
-
-				response = MHD_create_response_from_buffer (
-					strlen(con_info->answerstring.c_str()),
-					(void*) con_info->answerstring.c_str(),
-					MHD_RESPMEM_PERSISTENT
-				);
-
-				if (!response) {
-					return MHD_NO;
-				}
-
-				MHD_add_response_header(
-					response,
-					MHD_HTTP_HEADER_SET_COOKIE,
-					key_value
-				);
-
-				ret = MHD_queue_response(
-					connection,
-					MHD_HTTP_OK,
-					response
-				);
-				MHD_destroy_response(response);
-				return ret;
-			}  else {
-				return send_page_from_memory(
-					connection,
-					errorpage.c_str(),
-					MHD_HTTP_BAD_REQUEST
-				);
-			}
-
+		if (!con_info->matched_route) {
+			return MHD_NO;
 		}
-		return MHD_NO;
+		return con_info->matched_route->handler(connection, con_info);
 	} else {
 		response = MHD_create_response_from_buffer (
 			strlen(errorpage.c_str()),
@@ -437,27 +413,45 @@ main(
 	int argc,
 	char ** argv
 ) {
-	init_simulation();
-	float timer;
-	auto now = std::chrono::system_clock::now();
-	auto then = std::chrono::system_clock::now();
-
-	std::thread game_loop ([&]() {
-		while (true) {
-			then = std::chrono::system_clock::now();
-			auto duration = then - now;
-			auto milliseconds =
-				std::chrono::duration_cast<std::chrono::milliseconds>(duration);
-			if (milliseconds.count() > 500) {
-				simulation_update();
-				now = then;
-			} else {
-				std::this_thread::sleep_for(std::chrono::milliseconds(1));
-			}
-		}
-	});
+	configure_command_queues(read_setting("COMMAND_QUEUE_CAPACITY", default_command_queue_capacity));
+	// sparse keeps memory in check with hundreds of commodities, dense runs production in vectors
+	auto stockpile_layout = read_text_setting("STOCKPILE_LAYOUT", "dense");
+	configure_stockpiles(strcmp(stockpile_layout, "sparse") == 0 ? inventory_layout::sparse : inventory_layout::dense);
+	auto snapshot_path = read_text_setting("SNAPSHOT_PATH", "world.snapshot");
+	auto log_path = read_text_setting("COMMAND_LOG_PATH", "world.log");
+	auto recovered = recover_simulation(snapshot_path, log_path);
+	if (recovered == recovery_result::failed) {
+		printf(
+			"%s exists but can't be loaded, move it and %s aside to start a new world\n",
+			snapshot_path,
+			log_path
+		);
+		return 1;
+	}
+	if (recovered == recovery_result::none) {
+		init_simulation();
+	}
+	start_persistence(snapshot_path, log_path, read_setting("SNAPSHOT_INTERVAL_TICKS", 120));
+	// never truncated, turn on to reproduce incidents with ./replay
+	auto recording_path = read_text_setting("RECORDING_PATH", "");
+	if (recording_path[0] != 0) {
+		start_recording(recording_path);
+	}
 
-	game_loop.detach();
+	auto policy = strcmp(read_text_setting("TICK_OVERRUN_POLICY", "skip"), "catch_up") == 0
+		? overrun_policy::catch_up
+		: overrun_policy::skip;
+	auto tick_ms = read_setting("TICK_MS", 500);
+	if (tick_ms < 1) {
+		printf("TICK_MS must be at least 1, using 1\n");
+		tick_ms = 1;
+	}
+	tick_scheduler game_loop {
+		std::chrono::milliseconds(tick_ms),
+		policy,
+		(uint32_t)read_setting("TICK_MAX_CATCH_UP", 5),
+		simulation_update
+	};
 
 	FILE * salt_container = fopen(".salt", "r");
 	if( salt_container ) {
@@ -479,9 +473,61 @@ main(
 	}
 
 	url_gen::set_base_prefix(argv[1]);
+	add_default_routes();
+	add_route(http_method::post, url_path::new_user, POST_login, iterate_post_new_user);
+	build_route_table();
+
+	// off by default: the file grows with every request and is never rotated
+	auto request_log_path = read_text_setting("REQUEST_LOG_PATH", "");
+	if (request_log_path[0] != 0) {
+		auto level = (log_level)std::clamp<int64_t>(read_setting("REQUEST_LOG_LEVEL", (int64_t)log_level::info), 0, 3);
+		if (!start_request_log(request_log_path, level, (uint32_t)read_setting("REQUEST_LOG_SAMPLE", 1))) {
+			printf("Failed to open %s, requests are not logged\n", request_log_path);
+		}
+	}
+
+	sessions.time_to_live = std::chrono::seconds(read_setting("SESSION_TTL_SECONDS", 7 * 24 * 60 * 60));
+
+	auto login_memory = read_setting("LOGIN_MEMORY_BUDGET_MB", 4 * LOGIN_JOB_MEMORY_MB);
+	auto login_workers = std::min(read_setting("LOGIN_WORKERS", 4), login_memory / LOGIN_JOB_MEMORY_MB);
+	if (login_memory < LOGIN_JOB_MEMORY_MB) {
+		// a login can't be hashed with less, one worker still runs
+		printf(
+			"LOGIN_MEMORY_BUDGET_MB %lld is below the %d MB of one login, logins will use %d MB\n",
+			(long long)login_memory,
+			LOGIN_JOB_MEMORY_MB,
+			LOGIN_JOB_MEMORY_MB
+		);
+	}
+	login_pool = std::make_unique<job_pool>(
+		"login",
+		(unsigned)std::max<int64_t>(login_workers, 1),
+		(size_t)read_setting("LOGIN_BACKLOG", 256)
+	);
+
+	start_command_waiting(
+		std::chrono::milliseconds(read_setting("COMMAND_TIMEOUT_MS", 5000)),
+		(size_t)read_setting("COMMAND_WAITERS", 4096)
+	);
+
+	// sections are registered before the first request can read them
+	add_metrics_section(write_simulation_metrics);
+	add_metrics_section(write_page_cache_metrics);
+	add_metrics_section(write_ticket_metrics);
+	add_metrics_section(write_request_log_metrics);
+	add_metrics_section([&](std::string& result) {
+		game_loop.write_metrics(result);
+	});
+	add_metrics_section([](std::string& result) {
+		login_pool->write_metrics(result);
+		result += "# TYPE sessions gauge\n";
+		result += "sessions " + std::to_string(sessions.size()) + "\n";
+	});
 
+	// every pool thread runs its own epoll loop, 1 keeps the single polling thread
+	auto http_threads = read_setting("HTTP_THREADS", std::max(1u, std::thread::hardware_concurrency()));
 	d = MHD_start_daemon(
-		MHD_USE_EPOLL | MHD_USE_INTERNAL_POLLING_THREAD,
+		MHD_USE_EPOLL | MHD_USE_INTERNAL_POLLING_THREAD | MHD_ALLOW_SUSPEND_RESUME,
 		atoi(argv[2]),
 		NULL,
 		NULL,
@@ -490,12 +536,30 @@ main(
 		MHD_OPTION_NOTIFY_COMPLETED,
 		&request_completed,
 		NULL,
+		MHD_OPTION_THREAD_POOL_SIZE,
+		(unsigned int)std::max<int64_t>(http_threads, 1),
+		MHD_OPTION_CONNECTION_LIMIT,
+		(unsigned int)read_setting("HTTP_CONNECTION_LIMIT", 4096),
+		MHD_OPTION_PER_IP_CONNECTION_LIMIT,
+		(unsigned int)read_setting("HTTP_PER_IP_CONNECTION_LIMIT", 0),
+		MHD_OPTION_CONNECTION_TIMEOUT,
+		(unsigned int)read_setting("HTTP_CONNECTION_TIMEOUT_SECONDS", 30),
 		MHD_OPTION_END
 	);
 
 	if (NULL == d)
 		return 1;
+	game_loop.start();
 	(void) getc (stdin);
+	// suspended logins have to be resumed before the daemon stops
+	login_pool->stop();
+	// so do commands waiting for their tick: the tick resolves tickets too,
+	// it has to be stopped first so nothing resumes a connection the daemon is freeing
+	game_loop.stop();
+	stop_command_tickets();
 	MHD_stop_daemon(d);
+	stop_request_log();
+	stop_persistence();
+	stop_recording();
 	return 0;
 }
\ No newline at end of file
@@ -0,0 +1,110 @@
+#include "metrics.hpp"
+#include <algorithm>
+#include <format>
+#include <vector>
+
+static latency_histogram phase_latency[(size_t)tick_phase::count];
+static latency_histogram tick_latency;
+
+static const char* phase_names[(size_t)tick_phase::count] = {
+	"gacha",
+	"construction",
+	"settings",
+	"transfer_requests",
+	"demand",
+	"supply",
+	"market",
+	"production",
+	"construction_siphon",
+	"transfer_flow",
+	"publish",
+	"persistence"
+};
+
+static constinit metered_mutex* first_registered_mutex = nullptr;
+static std::vector<std::function<void(std::string&)>> sections;
+
+void latency_histogram::record(std::chrono::nanoseconds duration) {
+	auto ns = (uint64_t) std::max<int64_t>(duration.count(), 0);
+	auto us = ns / 1000;
+	int bucket = 0;
+	while (bucket < buckets && us >= (uint64_t(1) << bucket)) {
+		bucket++;
+	}
+	counts[bucket].fetch_add(1, std::memory_order_relaxed);
+	sum_ns.fetch_add(ns, std::memory_order_relaxed);
+	samples.fetch_add(1, std::memory_order_relaxed);
+}
+
+void latency_histogram::write(std::string& result, const char* name, std::string const& labels) const {
+	auto separator = labels.empty() ? "" : ",";
+	uint64_t cumulative = 0;
+	for (int i = 0; i < buckets; i++) {
+		cumulative += counts[i].load(std::memory_order_relaxed);
+		result += std::format(
+			"{}_bucket{{{}{}le=\"{}\"}} {}\n",
+			name, labels, separator, double(uint64_t(1) << i) / 1e6, cumulative
+		);
+	}
+	cumulative += counts[buckets].load(std::memory_order_relaxed);
+	result += std::format("{}_bucket{{{}{}le=\"+Inf\"}} {}\n", name, labels, separator, cumulative);
+	result += std::format("{}_sum{{{}}} {}\n", name, labels, double(sum_ns.load(std::memory_order_relaxed)) / 1e9);
+	result += std::format("{}_count{{{}}} {}\n", name, labels, samples.load(std::memory_order_relaxed));
+}
+
+void record_phase(tick_phase phase, std::chrono::nanoseconds duration) {
+	phase_latency[(size_t)phase].record(duration);
+}
+
+void record_tick(std::chrono::nanoseconds duration) {
+	tick_latency.record(duration);
+}
+
+// mutexes are globals, so registration happens during static initialization
+metered_mutex::metered_mutex(const char* name) : name(name) {
+	next_registered = first_registered_mutex;
+	first_registered_mutex = this;
+}
+
+void write_phase_metrics(std::string& result) {
+	result += "# TYPE tick_duration_seconds histogram\n";
+	tick_latency.write(result, "tick_duration_seconds", "");
+	result += "# TYPE tick_phase_duration_seconds histogram\n";
+	for (size_t i = 0; i < (size_t)tick_phase::count; i++) {
+		phase_latency[i].write(
+			result,
+			"tick_phase_duration_seconds",
+			std::format("phase=\"{}\"", phase_names[i])
+		);
+	}
+}
+
+// every family is one block under its own TYPE line, strict parsers reject split ones
+void write_lock_metrics(std::string& result) {
+	result += "# TYPE lock_acquisitions_total counter\n";
+	for (auto mutex = first_registered_mutex; mutex; mutex = mutex->next_registered) {
+		result += std::format("lock_acquisitions_total{{lock=\"{}\"}} {}\n", mutex->name, mutex->acquisitions.load(std::memory_order_relaxed));
+	}
+	result += "# TYPE lock_contended_total counter\n";
+	for (auto mutex = first_registered_mutex; mutex; mutex = mutex->next_registered) {
+		result += std::format("lock_contended_total{{lock=\"{}\"}} {}\n", mutex->name, mutex->contended.load(std::memory_order_relaxed));
+	}
+	result += "# TYPE lock_wait_seconds histogram\n";
+	for (auto mutex = first_registered_mutex; mutex; mutex = mutex->next_registered) {
+		mutex->wait.write(result, "lock_wait_seconds", std::format("lock=\"{}\"", mutex->name));
+	}
+}
+
+void add_metrics_section(std::function<void(std::string&)> section) {
+	sections.push_back(std::move(section));
+}
+
+std::string render_metrics() {
+	std::string result;
+	write_phase_metrics(result);
+	write_lock_metrics(result);
+	for (auto& section : sections) {
+		section(result);
+	}
+	return result;
+}
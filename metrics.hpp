@@ -0,0 +1,107 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+
+/*
+
+Low overhead instrumentation exported in Prometheus text format.
+Recording is a few relaxed atomic increments, rendering happens only on scrape.
+
+*/
+
+struct latency_histogram {
+	// bucket i counts samples below 2^i microseconds, the last one counts everything else
+	static constexpr int buckets = 24;
+	std::atomic<uint64_t> counts[buckets + 1] {};
+	std::atomic<uint64_t> sum_ns {0};
+	std::atomic<uint64_t> samples {0};
+
+	void record(std::chrono::nanoseconds duration);
+	void write(std::string& result, const char* name, std::string const& labels) const;
+};
+
+enum class tick_phase : uint8_t {
+	gacha,
+	construction,
+	settings,
+	transfer_requests,
+	demand,
+	supply,
+	market,
+	production,
+	construction_siphon,
+	transfer_flow,
+	publish,
+	persistence,
+	count
+};
+
+void record_phase(tick_phase phase, std::chrono::nanoseconds duration);
+void record_tick(std::chrono::nanoseconds duration);
+
+// Measures consecutive phases with one clock read per boundary.
+struct phase_timer {
+	tick_phase phase;
+	std::chrono::steady_clock::time_point start;
+
+	explicit phase_timer(tick_phase phase) : phase(phase), start(std::chrono::steady_clock::now()) {}
+
+	void next(tick_phase following) {
+		auto now = std::chrono::steady_clock::now();
+		record_phase(phase, now - start);
+		phase = following;
+		start = now;
+	}
+
+	void finish() {
+		record_phase(phase, std::chrono::steady_clock::now() - start);
+		phase = tick_phase::count;
+	}
+
+	~phase_timer() {
+		if (phase != tick_phase::count) finish();
+	}
+};
+
+// std::mutex which measures how long contended lock() calls wait.
+struct metered_mutex {
+	const char* name;
+	std::mutex mtx;
+	latency_histogram wait;
+	std::atomic<uint64_t> acquisitions {0};
+	std::atomic<uint64_t> contended {0};
+	metered_mutex* next_registered;
+
+	explicit metered_mutex(const char* name);
+
+	void lock() {
+		if (!mtx.try_lock()) {
+			auto start = std::chrono::steady_clock::now();
+			mtx.lock();
+			wait.record(std::chrono::steady_clock::now() - start);
+			contended.fetch_add(1, std::memory_order_relaxed);
+		}
+		acquisitions.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	bool try_lock() {
+		if (!mtx.try_lock()) return false;
+		acquisitions.fetch_add(1, std::memory_order_relaxed);
+		return true;
+	}
+
+	void unlock() {
+		mtx.unlock();
+	}
+};
+
+void write_phase_metrics(std::string& result);
+void write_lock_metrics(std::string& result);
+
+// Sections owned by other modules, registered before the server starts.
+void add_metrics_section(std::function<void(std::string&)> section);
+std::string render_metrics();
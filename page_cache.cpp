@@ -0,0 +1,92 @@
+#include "page_cache.hpp"
+#include <array>
+#include <atomic>
+#include <format>
+#include <mutex>
+#include "unordered_dense.h"
+
+struct page_key_hash {
+	using is_avalanching = void;
+	uint64_t operator()(page_key const& key) const noexcept {
+		uint64_t packed = ((uint64_t)key.route << 56) ^ ((uint64_t)(uint32_t)key.id << 24) ^ (uint64_t)(uint32_t)key.user;
+		return ankerl::unordered_dense::hash<uint64_t>{}(packed);
+	}
+};
+
+struct cached_page {
+	uint64_t version;
+	shared_page page;
+};
+
+static constexpr size_t cache_shards = 16;
+static constexpr size_t shard_capacity = 4096;
+
+struct alignas(64) cache_shard {
+	std::mutex mtx;
+	ankerl::unordered_dense::map<page_key, cached_page, page_key_hash> pages;
+};
+
+static std::array<cache_shard, cache_shards> shards;
+
+static std::atomic<uint64_t> hits {0};
+static std::atomic<uint64_t> misses {0};
+static std::atomic<uint64_t> not_modified {0};
+
+static cache_shard& shard_of(page_key const& key) {
+	return shards[page_key_hash{}(key) % cache_shards];
+}
+
+shared_page find_cached_page(page_key key, uint64_t version) {
+	auto& shard = shard_of(key);
+	std::lock_guard<std::mutex> lock {shard.mtx};
+	auto it = shard.pages.find(key);
+	if (it == shard.pages.end() || it->second.version != version) {
+		misses.fetch_add(1, std::memory_order_relaxed);
+		return {};
+	}
+	hits.fetch_add(1, std::memory_order_relaxed);
+	return it->second.page;
+}
+
+void store_cached_page(page_key key, uint64_t version, shared_page page) {
+	auto& shard = shard_of(key);
+	std::lock_guard<std::mutex> lock {shard.mtx};
+	if (shard.pages.size() >= shard_capacity && !shard.pages.contains(key)) {
+		// drop everything older than the page being stored, start over if that isn't enough
+		for (auto it = shard.pages.begin(); it != shard.pages.end();) {
+			if (it->second.version < version) {
+				it = shard.pages.erase(it);
+			} else {
+				++it;
+			}
+		}
+		if (shard.pages.size() >= shard_capacity) {
+			shard.pages.clear();
+		}
+	}
+	shard.pages[key] = {version, std::move(page)};
+}
+
+shared_page share_page(page_writer_ptr page) {
+	return shared_page {page.release(), page_writer_release{}};
+}
+
+void count_not_modified() {
+	not_modified.fetch_add(1, std::memory_order_relaxed);
+}
+
+void write_page_cache_metrics(std::string& result) {
+	size_t entries = 0;
+	for (auto& shard : shards) {
+		std::lock_guard<std::mutex> lock {shard.mtx};
+		entries += shard.pages.size();
+	}
+	result += "# TYPE page_cache_entries gauge\n";
+	result += std::format("page_cache_entries {}\n", entries);
+	result += "# TYPE page_cache_hits_total counter\n";
+	result += std::format("page_cache_hits_total {}\n", hits.load(std::memory_order_relaxed));
+	result += "# TYPE page_cache_misses_total counter\n";
+	result += std::format("page_cache_misses_total {}\n", misses.load(std::memory_order_relaxed));
+	result += "# TYPE page_cache_not_modified_total counter\n";
+	result += std::format("page_cache_not_modified_total {}\n", not_modified.load(std::memory_order_relaxed));
+}
@@ -0,0 +1,32 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <string>
+#include "html_writer.hpp"
+
+/*
+
+Rendered pages shared between requests until the world changes.
+Pages built from the per tick view are stored with the tick as their version,
+pages which depend only on the catalog of building types use the catalog version.
+A stale entry is never served: lookups compare versions and the next store replaces it.
+
+*/
+
+using shared_page = std::shared_ptr<html_writer const>;
+
+struct page_key {
+	uint8_t route;
+	int32_t id;
+	int32_t user;
+
+	bool operator==(page_key const& other) const = default;
+};
+
+shared_page find_cached_page(page_key key, uint64_t version);
+void store_cached_page(page_key key, uint64_t version, shared_page page);
+// the page stays pooled: it goes back once neither the cache nor a response holds it
+shared_page share_page(page_writer_ptr page);
+
+void count_not_modified();
+void write_page_cache_metrics(std::string& result);
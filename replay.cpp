@@ -0,0 +1,72 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "simulation.hpp"
+#include "constants.hpp"
+
+/*
+
+Replays a recording made with RECORDING_PATH as fast as possible.
+Ticks are applied exactly as the server applied them, so a slow tick
+can be profiled offline, for example under perf record.
+
+	./replay recording.log [slowest ticks to list] [command queue capacity]
+
+*/
+
+struct tick_timing {
+	uint64_t tick;
+	double milliseconds;
+};
+
+static int read_argument(int argc, char** argv, int index, int fallback) {
+	if (argc <= index) return fallback;
+	return atoi(argv[index]);
+}
+
+int main(int argc, char** argv) {
+	if (argc < 2) {
+		printf("usage: %s recording.log [slowest ticks to list] [command queue capacity]\n", argv[0]);
+		return 1;
+	}
+	auto path = argv[1];
+	size_t slowest = read_argument(argc, argv, 2, 10);
+	configure_command_queues(read_argument(argc, argv, 3, default_command_queue_capacity));
+
+	std::vector<tick_timing> timings;
+	auto start = std::chrono::steady_clock::now();
+	auto replayed = replay_recording(path, [&](uint64_t tick, std::chrono::steady_clock::duration duration) {
+		timings.push_back({tick, std::chrono::duration<double, std::milli>(duration).count()});
+	});
+	auto total = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start);
+	if (replayed == 0) {
+		printf("Nothing to replay in %s\n", path);
+		return 1;
+	}
+
+	double ticks_total = 0;
+	for (auto& timing : timings) {
+		ticks_total += timing.milliseconds;
+	}
+	printf(
+		"replayed %llu ticks (%llu to %llu) in %.1f ms, %.1f ms inside ticks\n",
+		(unsigned long long)replayed,
+		(unsigned long long)timings.front().tick,
+		(unsigned long long)timings.back().tick,
+		total.count(),
+		ticks_total
+	);
+
+	slowest = std::min(slowest, timings.size());
+	std::partial_sort(timings.begin(), timings.begin() + slowest, timings.end(), [](auto& a, auto& b) {
+		return a.milliseconds > b.milliseconds;
+	});
+	for (size_t i = 0; i < slowest; i++) {
+		printf("tick %llu: %.3f ms\n", (unsigned long long)timings[i].tick, timings[i].milliseconds);
+	}
+	return 0;
+}
@@ -0,0 +1,167 @@
+#include "request_log.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <format>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+static constexpr size_t ring_capacity = 4096;
+static constexpr auto drain_period = std::chrono::milliseconds(50);
+
+// one producer: the thread which owns it, one consumer: the drain thread
+struct log_ring {
+	std::unique_ptr<request_log_entry[]> entries = std::make_unique<request_log_entry[]>(ring_capacity);
+	alignas(64) std::atomic<size_t> head {0};
+	alignas(64) std::atomic<size_t> tail {0};
+	std::atomic<uint64_t> dropped {0};
+	uint32_t sample_position = 0;
+	uint16_t thread;
+};
+
+static std::atomic<bool> enabled {false};
+static std::atomic<uint8_t> minimum_level {uint8_t(log_level::info)};
+static uint32_t sample_every = 1;
+static FILE* file = nullptr;
+
+// rings outlive their threads, they are only freed with the log
+static std::mutex rings_mutex;
+static std::vector<std::unique_ptr<log_ring>> rings;
+static thread_local log_ring* local_ring = nullptr;
+
+static std::atomic<uint64_t> written {0};
+static std::mutex drain_mutex;
+static std::condition_variable drain_wake;
+static bool drain_stopping = false;
+static std::thread drainer;
+
+static log_ring* thread_ring() {
+	if (local_ring) return local_ring;
+	std::lock_guard<std::mutex> lock {rings_mutex};
+	auto ring = std::make_unique<log_ring>();
+	ring->thread = (uint16_t)rings.size();
+	local_ring = ring.get();
+	rings.push_back(std::move(ring));
+	return local_ring;
+}
+
+static size_t drain(log_ring& ring) {
+	auto tail = ring.tail.load(std::memory_order_relaxed);
+	auto head = ring.head.load(std::memory_order_acquire);
+	for (auto position = tail; position != head; position++) {
+		auto& entry = ring.entries[position % ring_capacity];
+		fwrite(&entry, 1, request_log_entry_header_size + entry.text_size, file);
+	}
+	ring.tail.store(head, std::memory_order_release);
+	return head - tail;
+}
+
+static void drain_all() {
+	size_t count = 0;
+	{
+		std::lock_guard<std::mutex> lock {rings_mutex};
+		for (auto& ring : rings) {
+			count += drain(*ring);
+		}
+	}
+	if (count > 0) {
+		fflush(file);
+		written.fetch_add(count, std::memory_order_relaxed);
+	}
+}
+
+bool start_request_log(const char* path, log_level min_level, uint32_t sample) {
+	file = fopen(path, "ab");
+	if (!file) return false;
+	fseek(file, 0, SEEK_END);
+	if (ftell(file) == 0) {
+		fwrite(request_log_magic, 1, sizeof(request_log_magic), file);
+	}
+	minimum_level.store(uint8_t(min_level), std::memory_order_relaxed);
+	sample_every = std::max<uint32_t>(sample, 1);
+	drain_stopping = false;
+	drainer = std::thread([]() {
+		std::unique_lock<std::mutex> lock {drain_mutex};
+		while (!drain_wake.wait_for(lock, drain_period, []() { return drain_stopping; })) {
+			drain_all();
+		}
+	});
+	enabled.store(true, std::memory_order_release);
+	return true;
+}
+
+void stop_request_log() {
+	if (!file) return;
+	enabled.store(false, std::memory_order_relaxed);
+	{
+		std::lock_guard<std::mutex> lock {drain_mutex};
+		drain_stopping = true;
+	}
+	drain_wake.notify_all();
+	if (drainer.joinable()) drainer.join();
+	drain_all();
+	fclose(file);
+	file = nullptr;
+}
+
+bool request_log_enabled(log_level level) {
+	return enabled.load(std::memory_order_relaxed)
+		&& uint8_t(level) >= minimum_level.load(std::memory_order_relaxed);
+}
+
+void log_request_event(
+	log_level level,
+	request_event event,
+	std::string_view text,
+	int32_t user,
+	uint8_t method,
+	uint8_t code,
+	uint32_t duration_us
+) {
+	if (!request_log_enabled(level)) return;
+	auto ring = thread_ring();
+	if (level < log_level::warning && ring->sample_position++ % sample_every != 0) return;
+
+	auto head = ring->head.load(std::memory_order_relaxed);
+	if (head - ring->tail.load(std::memory_order_acquire) >= ring_capacity) {
+		ring->dropped.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+	auto& entry = ring->entries[head % ring_capacity];
+	entry.time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::system_clock::now().time_since_epoch()
+	).count();
+	entry.duration_us = duration_us;
+	entry.user = user;
+	entry.thread = ring->thread;
+	entry.level = level;
+	entry.event = event;
+	entry.method = method;
+	entry.code = code;
+	entry.text_size = (uint8_t)std::min(text.size(), request_log_text_size);
+	memcpy(entry.text, text.data(), entry.text_size);
+	ring->head.store(head + 1, std::memory_order_release);
+}
+
+void write_request_log_metrics(std::string& result) {
+	uint64_t dropped = 0;
+	size_t threads = 0;
+	{
+		std::lock_guard<std::mutex> lock {rings_mutex};
+		threads = rings.size();
+		for (auto& ring : rings) {
+			dropped += ring->dropped.load(std::memory_order_relaxed);
+		}
+	}
+	result += "# TYPE request_log_written_total counter\n";
+	result += std::format("request_log_written_total {}\n", written.load(std::memory_order_relaxed));
+	result += "# TYPE request_log_dropped_total counter\n";
+	result += std::format("request_log_dropped_total {}\n", dropped);
+	result += "# TYPE request_log_threads gauge\n";
+	result += std::format("request_log_threads {}\n", threads);
+}
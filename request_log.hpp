@@ -0,0 +1,69 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+/*
+
+Binary request log kept off the request path.
+Every thread writes fixed size entries into its own single producer ring,
+a background thread drains the rings into the file. A full ring drops entries
+instead of waiting. Info and debug entries can be sampled, warnings and errors never are.
+
+On disk: the magic, then entries cut right after their text_size bytes of text.
+./log_dump prints them as lines.
+
+*/
+
+enum class log_level : uint8_t {
+	debug, info, warning, error
+};
+
+enum class request_event : uint8_t {
+	// a finished request: text is the route, code the MHD termination code
+	request,
+	// a header of a request: text is its name, values are never logged
+	header
+};
+
+constexpr uint8_t log_method_get = 1;
+constexpr uint8_t log_method_post = 2;
+
+constexpr size_t request_log_text_size = 105;
+constexpr char request_log_magic[8] = {'0', '1', '1', 'R', 'L', 'O', 'G', '1'};
+
+struct request_log_entry {
+	// nanoseconds since the epoch
+	int64_t time;
+	uint32_t duration_us;
+	int32_t user;
+	uint16_t thread;
+	log_level level;
+	request_event event;
+	uint8_t method;
+	uint8_t code;
+	uint8_t text_size;
+	char text[request_log_text_size];
+};
+static_assert(sizeof(request_log_entry) == 128);
+
+constexpr size_t request_log_entry_header_size = offsetof(request_log_entry, text);
+
+// entries below min_level are discarded, one of every sample_every info and debug entries is kept
+bool start_request_log(const char* path, log_level min_level, uint32_t sample_every);
+void stop_request_log();
+
+// cheap enough to call before building an entry
+bool request_log_enabled(log_level level);
+void log_request_event(
+	log_level level,
+	request_event event,
+	std::string_view text,
+	int32_t user = -1,
+	uint8_t method = 0,
+	uint8_t code = 0,
+	uint32_t duration_us = 0
+);
+
+void write_request_log_metrics(std::string& result);
@@ -1,10 +1,19 @@
 #include "routing.hpp"
 #include "microhttpd.h"
+#include "command_ticket.hpp"
 #include "data_ids.hpp"
 #include "simulation.hpp"
 #include "html-gen.hpp"
+#include "html_writer.hpp"
+#include "metrics.hpp"
+#include "page_cache.hpp"
 #include "url.hpp"
+#include <charconv>
+#include <cstdio>
+#include <cstring>
 #include <format>
+#include <string_view>
+#include <vector>
 
 static const std::string errorpage =  "<html><body>Error page.</body></html>";
 static const std::string successpage =  "<html><body>Success.</body></html>";
@@ -28,19 +37,138 @@ send_page_from_memory (
 	return ret;
 }
 
+static void free_page(void* cls) {
+	release_page_writer((html_writer*) cls);
+}
+
+static void free_shared_page(void* cls) {
+	delete (shared_page*) cls;
+}
+
+static MHD_Response* make_segments_response(
+	html_writer const& page,
+	MHD_ContentReaderFreeCallback free_callback,
+	void* free_cls
+) {
+	thread_local std::vector<page_segment> segments;
+	thread_local std::vector<MHD_IoVec> vectors;
+	segments.clear();
+	page.segments(segments);
+
+	if (segments.size() <= 1) {
+		return MHD_create_response_from_buffer_with_free_callback_cls (
+			segments.empty() ? 0 : segments[0].size,
+			segments.empty() ? "" : segments[0].data,
+			free_callback,
+			free_cls
+		);
+	}
+	vectors.clear();
+	for (auto& segment : segments) {
+		vectors.push_back({segment.data, segment.size});
+	}
+	return MHD_create_response_from_iovec (
+		vectors.data(),
+		(unsigned int) vectors.size(),
+		free_callback,
+		free_cls
+	);
+}
+
+MHD_Response* make_page_response(page_writer_ptr page) {
+	// the response owns the writer from here and gives it back to the pool in free_page
+	auto writer = page.release();
+	auto response = make_segments_response(*writer, free_page, writer);
+	if (!response) release_page_writer(writer);
+	return response;
+}
+
+static MHD_Response* make_shared_page_response(shared_page const& page) {
+	// every response keeps its own reference, so the cache may drop the page meanwhile
+	auto reference = new shared_page(page);
+	auto response = make_segments_response(*page, free_shared_page, reference);
+	if (!response) delete reference;
+	return response;
+}
+
+// If-None-Match is a comma separated list compared weakly, so W/ prefixes are ignored
+static bool etag_matches(std::string_view requested, std::string_view etag) {
+	while (!requested.empty()) {
+		auto comma = requested.find(',');
+		auto tag = requested.substr(0, comma);
+		requested = comma == std::string_view::npos ? std::string_view{} : requested.substr(comma + 1);
+		auto first = tag.find_first_not_of(" \t");
+		if (first == std::string_view::npos) continue;
+		tag = tag.substr(first, tag.find_last_not_of(" \t") - first + 1);
+		if (tag == "*") return true;
+		if (tag.starts_with("W/")) tag.remove_prefix(2);
+		if (tag == etag) return true;
+	}
+	return false;
+}
+
+// cached pages are revalidated with an ETag instead of being rendered again
+template<typename Render>
 static enum MHD_Result
-send_page_copy (
+send_cached_page (
 	struct MHD_Connection *connection,
-	const char* page,
-	int status_code
+	page_key key,
+	char version_kind,
+	uint64_t version,
+	Render&& render
 ) {
-	enum MHD_Result ret;
+	char etag[96];
+	snprintf(
+		etag, sizeof(etag),
+		"\"%c%llu-u%d-r%d-i%d\"",
+		version_kind,
+		(unsigned long long)version,
+		key.user,
+		(int)key.route,
+		key.id
+	);
+
 	struct MHD_Response *response;
-	response = MHD_create_response_from_buffer (
-		strlen (page),
-		(void*) page,
-		MHD_RESPMEM_MUST_COPY
+	int status_code = MHD_HTTP_OK;
+	const char * requested = MHD_lookup_connection_value(
+		connection,
+		MHD_HEADER_KIND,
+		MHD_HTTP_HEADER_IF_NONE_MATCH
 	);
+	if (requested && etag_matches(requested, etag)) {
+		count_not_modified();
+		status_code = MHD_HTTP_NOT_MODIFIED;
+		response = MHD_create_response_empty(MHD_RF_NONE);
+	} else {
+		auto page = find_cached_page(key, version);
+		if (!page) {
+			auto writer = make_page_writer();
+			render(*writer);
+			page = share_page(std::move(writer));
+			store_cached_page(key, version, page);
+		}
+		response = make_shared_page_response(page);
+	}
+	if (!response) return MHD_NO;
+	MHD_add_response_header(response, MHD_HTTP_HEADER_ETAG, etag);
+	MHD_add_response_header(response, MHD_HTTP_HEADER_CACHE_CONTROL, "no-cache");
+	auto ret = MHD_queue_response (connection, status_code, response);
+	MHD_destroy_response (response);
+	return ret;
+}
+
+static uint64_t current_view_tick() {
+	return view_tick(*acquire_view());
+}
+
+static enum MHD_Result
+send_page (
+	struct MHD_Connection *connection,
+	page_writer_ptr page,
+	int status_code
+) {
+	enum MHD_Result ret;
+	struct MHD_Response *response = make_page_response(std::move(page));
 	if (!response) return MHD_NO;
 	ret = MHD_queue_response (connection, status_code, response);
 	MHD_destroy_response (response);
@@ -63,6 +191,25 @@ MHD_Result lack_of_storage(struct MHD_Connection * connection) {
 	);
 }
 
+MHD_Result queue_is_full(struct MHD_Connection * connection) {
+	struct MHD_Response *response;
+	response = MHD_create_response_from_buffer (
+		errorpage.size(),
+		(void*) errorpage.c_str(),
+		MHD_RESPMEM_PERSISTENT
+	);
+	if (!response) return MHD_NO;
+	MHD_add_response_header(response, MHD_HTTP_HEADER_RETRY_AFTER, "1");
+	auto ret = MHD_queue_response (connection, MHD_HTTP_SERVICE_UNAVAILABLE, response);
+	MHD_destroy_response (response);
+	return ret;
+}
+
+MHD_Result reject_request(struct MHD_Connection * connection, request_status status) {
+	if (status == request_status::queue_full) return queue_is_full(connection);
+	return lack_of_storage(connection);
+}
+
 MHD_Result invalid_value(struct MHD_Connection * connection) {
 	return send_page_from_memory(
 		connection,
@@ -71,8 +218,9 @@ MHD_Result invalid_value(struct MHD_Connection * connection) {
 	);
 }
 
-std::string inline wrap_into_anchor(std::string url, std::string text) {
-	return "<a href=\"" + url + "\">" + text + "</a>";
+// applied commands get 200, commands which are still queued when their ticket times out get 202
+static const char* command_title(int status_code) {
+	return status_code == MHD_HTTP_OK ? "Request applied" : "Request accepted";
 }
 
 static enum MHD_Result
@@ -81,10 +229,11 @@ send_link_to_main_menu (
 	connection_info_struct * con_info,
 	int status_code
 ) {
-	std::string result = "<html><head><title>Request accepted</title></head><body><h1>Request accepted</h1>Meanwhile, you can ";
-	auto& page = con_info->current_page;
-	result += wrap_into_anchor(url_gen::main_mage(), "return back to the main menu");
-	return send_page_copy(connection, result.c_str(), status_code);
+	auto title = command_title(status_code);
+	auto out = make_page_writer();
+	out->raw("<html><head><title>").raw(title).raw("</title></head><body><h1>").raw(title).raw("</h1>Meanwhile, you can ");
+	out->raw("<a href=\"").url(url_path::main_page).raw("\">return back to the main menu</a>");
+	return send_page(connection, std::move(out), status_code);
 }
 
 static enum MHD_Result
@@ -93,10 +242,64 @@ send_link_to_gacha (
 	connection_info_struct * con_info,
 	int status_code
 ) {
-	std::string result = "<html><head><title>Request accepted</title></head><body><h1>Request accepted</h1>Meanwhile, you can ";
-	auto& page = con_info->current_page;
-	result += wrap_into_anchor(url_gen::gacha_page(), "return back to the RGO Acquisition page");
-	return send_page_copy(connection, result.c_str(), status_code);
+	auto title = command_title(status_code);
+	auto out = make_page_writer();
+	out->raw("<html><head><title>").raw(title).raw("</title></head><body><h1>").raw(title).raw("</h1>Meanwhile, you can ");
+	out->raw("<a href=\"").url(url_path::gacha_page).raw("\">return back to the RGO Acquisition page</a>");
+	return send_page(connection, std::move(out), status_code);
+}
+
+static void wake_connection(void* waiter) {
+	MHD_resume_connection((struct MHD_Connection*) waiter);
+}
+
+void start_command_waiting(std::chrono::milliseconds timeout, size_t capacity) {
+	start_command_tickets(capacity, timeout, wake_connection);
+}
+
+static command_outcome to_outcome(request_status status) {
+	return status == request_status::queue_full ? command_outcome::queue_full : command_outcome::rejected;
+}
+
+/*
+
+Commands are answered after the tick which applies them:
+the first call suspends the connection and queues the command with a ticket,
+the call after the resume answers with the outcome. MHD threads never wait.
+
+*/
+
+template<typename Submit, typename Reply>
+static MHD_Result await_command(
+	struct MHD_Connection * connection,
+	connection_info_struct * con_info,
+	Submit submit,
+	Reply reply
+) {
+	if (!con_info->ticket) {
+		auto ticket = claim_ticket();
+		if (!ticket) return queue_is_full(connection);
+		con_info->ticket = ticket;
+		// suspend first: the tick could otherwise resume a connection which is not suspended yet
+		MHD_suspend_connection(connection);
+		arm_ticket(ticket, connection);
+		auto status = submit(ticket);
+		if (status != request_status::accepted) {
+			resolve_ticket(ticket, to_outcome(status));
+		}
+		return MHD_YES;
+	}
+
+	auto outcome = take_ticket(con_info->ticket);
+	if (!outcome) return MHD_YES;
+	con_info->ticket = {};
+	switch (*outcome) {
+	case command_outcome::applied: return reply(MHD_HTTP_OK);
+	case command_outcome::timed_out: return reply(MHD_HTTP_ACCEPTED);
+	case command_outcome::queue_full: return reject_request(connection, request_status::queue_full);
+	case command_outcome::rejected: break;
+	}
+	return reject_request(connection, request_status::rejected);
 }
 
 MHD_Result POST_request_demand(
@@ -104,14 +307,17 @@ MHD_Result POST_request_demand(
 	connection_info_struct * con_info
 ) {
 	if(!con_info->user) return not_logged_in(connection);
-	auto result = request_demand(
-		con_info->user,
-		dcon::commodity_id {dcon::commodity_id::value_base_t (con_info->cid)},
-		con_info->price,
-		con_info->volume
-	);
-	if (!result) lack_of_storage(connection);
-	return send_link_to_main_menu(connection, con_info, MHD_HTTP_ACCEPTED);
+	return await_command(connection, con_info, [&](command_ticket ticket) {
+		return request_demand(
+			con_info->user,
+			dcon::commodity_id {dcon::commodity_id::value_base_t (con_info->cid)},
+			con_info->price,
+			con_info->volume,
+			ticket
+		);
+	}, [&](int status_code) {
+		return send_link_to_main_menu(connection, con_info, status_code);
+	});
 }
 
 MHD_Result POST_request_transfer(
@@ -119,15 +325,68 @@ MHD_Result POST_request_transfer(
 	connection_info_struct * con_info
 ) {
 	if(!con_info->user) return not_logged_in(connection);
-	auto result = request_transfer(
-		con_info->user,
-		dcon::storage_id {dcon::storage_id::value_base_t(con_info->id)},
-		dcon::storage_id {dcon::storage_id::value_base_t(con_info->id2)},
-		dcon::commodity_id {dcon::commodity_id::value_base_t (con_info->id3)},
-		con_info->volume
-	);
-	if (!result) lack_of_storage(connection);
-	return send_link_to_main_menu(connection, con_info, MHD_HTTP_ACCEPTED);
+	return await_command(connection, con_info, [&](command_ticket ticket) {
+		return request_transfer(
+			con_info->user,
+			dcon::storage_id {dcon::storage_id::value_base_t(con_info->id)},
+			dcon::storage_id {dcon::storage_id::value_base_t(con_info->id2)},
+			dcon::commodity_id {dcon::commodity_id::value_base_t (con_info->id3)},
+			con_info->volume,
+			ticket
+		);
+	}, [&](int status_code) {
+		return send_link_to_main_menu(connection, con_info, status_code);
+	});
+}
+
+MHD_Result POST_request_supply(
+	struct MHD_Connection * connection,
+	connection_info_struct * con_info
+) {
+	if(!con_info->user) return not_logged_in(connection);
+	return await_command(connection, con_info, [&](command_ticket ticket) {
+		return request_supply(
+			con_info->user,
+			dcon::commodity_id {dcon::commodity_id::value_base_t (con_info->cid)},
+			con_info->price,
+			con_info->volume,
+			ticket
+		);
+	}, [&](int status_code) {
+		return send_link_to_main_menu(connection, con_info, status_code);
+	});
+}
+
+MHD_Result POST_request_settings_change(
+	struct MHD_Connection * connection,
+	connection_info_struct * con_info
+) {
+	if(!con_info->user) return not_logged_in(connection);
+	return await_command(connection, con_info, [&](command_ticket ticket) {
+		return request_settings_change(
+			con_info->user,
+			dcon::building_id {dcon::building_id::value_base_t(con_info->id)},
+			con_info->id2,
+			ticket
+		);
+	}, [&](int status_code) {
+		return send_link_to_main_menu(connection, con_info, status_code);
+	});
+}
+
+MHD_Result POST_request_new_building(
+	struct MHD_Connection * connection,
+	connection_info_struct * con_info
+) {
+	if(!con_info->user) return not_logged_in(connection);
+	dcon::building_type_id btid {(dcon::building_type_id::value_base_t)con_info->id};
+	return await_command(connection, con_info, [&](command_ticket ticket) {
+		return request_new_building(con_info->user, btid, ticket);
+	}, [&](int status_code) {
+		auto page = make_page_writer();
+		make_building_type_report(*page, btid);
+		return send_page(connection, std::move(page), status_code);
+	});
 }
 
 MHD_Result POST_request_gacha_one(
@@ -135,12 +394,11 @@ MHD_Result POST_request_gacha_one(
 	connection_info_struct * con_info
 ) {
 	if(!con_info->user) return not_logged_in(connection);
-	auto result = request_gacha(
-		con_info->user,
-		1
-	);
-	if (!result) lack_of_storage(connection);
-	return send_link_to_gacha(connection, con_info, MHD_HTTP_ACCEPTED);
+	return await_command(connection, con_info, [&](command_ticket ticket) {
+		return request_gacha(con_info->user, 1, ticket);
+	}, [&](int status_code) {
+		return send_link_to_gacha(connection, con_info, status_code);
+	});
 }
 
 MHD_Result POST_request_gacha_ten(
@@ -148,12 +406,11 @@ MHD_Result POST_request_gacha_ten(
 	connection_info_struct * con_info
 ) {
 	if(!con_info->user) return not_logged_in(connection);
-	auto result = request_gacha(
-		con_info->user,
-		10
-	);
-	if (!result) lack_of_storage(connection);
-	return send_link_to_gacha(connection, con_info, MHD_HTTP_ACCEPTED);
+	return await_command(connection, con_info, [&](command_ticket ticket) {
+		return request_gacha(con_info->user, 10, ticket);
+	}, [&](int status_code) {
+		return send_link_to_gacha(connection, con_info, status_code);
+	});
 }
 
 MHD_Result send_main_page(
@@ -162,8 +419,10 @@ MHD_Result send_main_page(
 	dcon::user_id user
 ) {
 	current_page.page = page_type::main;
-	auto page = make_report(user);
-	return send_page_copy(connection, page.c_str(), MHD_HTTP_OK);
+	page_key key {(uint8_t)page_type::main, 0, (int32_t)user.index()};
+	return send_cached_page(connection, key, 't', current_view_tick(), [&](html_writer& out) {
+		make_report(out, user);
+	});
 }
 
 MHD_Result send_gacha_page(
@@ -172,8 +431,10 @@ MHD_Result send_gacha_page(
 	dcon::user_id user
 ) {
 	current_page.page = page_type::gacha;
-	auto page = resources_gacha(user);
-	return send_page_copy(connection, page.c_str(), MHD_HTTP_OK);
+	page_key key {(uint8_t)page_type::gacha, 0, (int32_t)user.index()};
+	return send_cached_page(connection, key, 't', current_view_tick(), [&](html_writer& out) {
+		resources_gacha(out, user);
+	});
 }
 
 MHD_Result send_building_type_page(
@@ -183,12 +444,16 @@ MHD_Result send_building_type_page(
 ) {
 	current_page.page = page_type::building;
 	current_page.id = id;
-	auto page = make_building_type_report(
-		dcon::building_type_id{
-			(dcon::building_type_id::value_base_t)id
-		}
-	);
-	return send_page_copy(connection, page.c_str(), MHD_HTTP_OK);
+	// the same for every user and every tick
+	page_key key {(uint8_t)page_type::building_type, id, -1};
+	return send_cached_page(connection, key, 'c', catalog_version(), [&](html_writer& out) {
+		make_building_type_report(
+			out,
+			dcon::building_type_id{
+				(dcon::building_type_id::value_base_t)id
+			}
+		);
+	});
 }
 
 MHD_Result send_building_page(
@@ -198,10 +463,172 @@ MHD_Result send_building_page(
 ) {
 	current_page.page = page_type::building;
 	current_page.id = id;
-	auto page = make_building_report(
-		dcon::building_id{
-			(dcon::building_id::value_base_t)id
-		}
+	// doesn't depend on who is looking
+	page_key key {(uint8_t)page_type::building, id, -1};
+	return send_cached_page(connection, key, 't', current_view_tick(), [&](html_writer& out) {
+		make_building_report(
+			out,
+			dcon::building_id{
+				(dcon::building_id::value_base_t)id
+			}
+		);
+	});
+}
+
+MHD_Result send_metrics_page(
+	struct MHD_Connection * connection
+) {
+	auto page = new std::string(render_metrics());
+	struct MHD_Response *response;
+	response = MHD_create_response_from_buffer_with_free_callback_cls (
+		page->size(),
+		page->data(),
+		[](void* cls) { delete (std::string*) cls; },
+		page
+	);
+	if (!response) {
+		delete page;
+		return MHD_NO;
+	}
+	MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE, "text/plain; version=0.0.4");
+	auto ret = MHD_queue_response (connection, MHD_HTTP_OK, response);
+	MHD_destroy_response (response);
+	return ret;
+}
+
+MHD_Result send_login_page(
+	struct MHD_Connection * connection
+) {
+	auto page = make_page_writer();
+	login_page(*page);
+	return send_page(connection, std::move(page), MHD_HTTP_OK);
+}
+
+static int32_t query_id(struct MHD_Connection * connection) {
+	const char * value = MHD_lookup_connection_value(
+		connection,
+		MHD_GET_ARGUMENT_KIND,
+		"id"
 	);
-	return send_page_copy(connection, page.c_str(), MHD_HTTP_OK);
-}
\ No newline at end of file
+	int32_t result = 0;
+	if (value) {
+		std::from_chars(value, value + strlen(value), result);
+	}
+	return result;
+}
+
+MHD_Result GET_main_page(
+	struct MHD_Connection * connection,
+	connection_info_struct * con_info
+) {
+	if (!con_info->user) return send_login_page(connection);
+	return send_main_page(connection, con_info->current_page, con_info->user);
+}
+
+static MHD_Result GET_gacha_page(
+	struct MHD_Connection * connection,
+	connection_info_struct * con_info
+) {
+	if (!con_info->user) return send_login_page(connection);
+	return send_gacha_page(connection, con_info->current_page, con_info->user);
+}
+
+static MHD_Result GET_building_page(
+	struct MHD_Connection * connection,
+	connection_info_struct * con_info
+) {
+	if (!con_info->user) return send_login_page(connection);
+	return send_building_page(connection, con_info->current_page, query_id(connection));
+}
+
+static MHD_Result GET_building_type_page(
+	struct MHD_Connection * connection,
+	connection_info_struct * con_info
+) {
+	if (!con_info->user) return send_login_page(connection);
+	return send_building_type_page(connection, con_info->current_page, query_id(connection));
+}
+
+static MHD_Result GET_metrics_page(
+	struct MHD_Connection * connection,
+	connection_info_struct * con_info
+) {
+	return send_metrics_page(connection);
+}
+
+/* ROUTE TABLE */
+
+static std::vector<route> routes;
+static std::vector<int32_t> route_slots;
+static uint64_t route_seed = 0;
+
+static uint64_t route_hash(uint64_t seed, http_method method, std::string_view path) {
+	// FNV-1a with a searched seed
+	uint64_t hash = (14695981039346656037ull ^ seed) + (uint64_t)method;
+	for (auto c : path) {
+		hash = (hash ^ (uint8_t)c) * 1099511628211ull;
+	}
+	return hash ^ (hash >> 32);
+}
+
+void add_route(
+	http_method method,
+	std::string_view path,
+	route_handler handler,
+	MHD_PostDataIterator post_iterator
+) {
+	routes.push_back({method, path, handler, post_iterator});
+}
+
+void add_default_routes() {
+	add_route(http_method::get, url_path::main_page, GET_main_page);
+	add_route(http_method::get, url_path::metrics, GET_metrics_page);
+	add_route(http_method::get, url_path::gacha_page, GET_gacha_page);
+	add_route(http_method::get, url_path::building, GET_building_page);
+	add_route(http_method::get, url_path::building_type, GET_building_type_page);
+
+	add_route(http_method::post, url_path::new_building, POST_request_new_building);
+	add_route(http_method::post, url_path::set_building, POST_request_settings_change);
+	add_route(http_method::post, url_path::set_transfer, POST_request_transfer);
+	add_route(http_method::post, url_path::new_demand, POST_request_demand);
+	add_route(http_method::post, url_path::new_supply, POST_request_supply);
+	add_route(http_method::post, url_path::one_pull, POST_request_gacha_one);
+	add_route(http_method::post, url_path::ten_pull, POST_request_gacha_ten);
+}
+
+void build_route_table() {
+	size_t size = 2;
+	while (size < routes.size() * 2) {
+		size <<= 1;
+	}
+	// routes are few, so a collision free seed is found after a handful of attempts
+	while (true) {
+		for (uint64_t seed = 1; seed < 1024; seed++) {
+			route_slots.assign(size, -1);
+			bool collision = false;
+			for (size_t i = 0; i < routes.size(); i++) {
+				auto slot = route_hash(seed, routes[i].method, routes[i].path) & (size - 1);
+				if (route_slots[slot] != -1) {
+					collision = true;
+					break;
+				}
+				route_slots[slot] = (int32_t)i;
+			}
+			if (!collision) {
+				route_seed = seed;
+				return;
+			}
+		}
+		size <<= 1;
+	}
+}
+
+route const* find_route(http_method method, std::string_view path) {
+	if (route_slots.empty()) return nullptr;
+	auto slot = route_hash(route_seed, method, path) & (route_slots.size() - 1);
+	auto index = route_slots[slot];
+	if (index == -1) return nullptr;
+	auto& candidate = routes[index];
+	if (candidate.method != method || candidate.path != path) return nullptr;
+	return &candidate;
+}
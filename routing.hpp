@@ -1,9 +1,15 @@
 #pragma once
+#include "command_ticket.hpp"
 #include "constants.hpp"
+#include <atomic>
+#include <chrono>
 #include <cstdint>
 #include <string>
+#include <string_view>
 #include "data_ids.hpp"
+#include "html_writer.hpp"
 #include "microhttpd.h"
+#include "simulation.hpp"
 
 enum class connection_type {
 	post, get
@@ -13,17 +19,42 @@ enum class page_type {
 	main, building, building_type, gacha
 };
 
+enum class login_state {
+	idle, hashing, done, rejected
+};
+
 struct page_ref {
 	page_type page;
 	std::optional<int> id;
 };
 
+struct connection_info_struct;
+
+enum class http_method : uint8_t {
+	get, post
+};
+
+using route_handler = MHD_Result (*)(
+	struct MHD_Connection * connection,
+	connection_info_struct * con_info
+);
+
+struct route {
+	http_method method;
+	std::string_view path;
+	route_handler handler;
+	// post processor used for the form of the route, the generic one when null
+	MHD_PostDataIterator post_iterator;
+};
+
 struct connection_info_struct
 {
-	connection_type connectiontype;
+	connection_type connectiontype = connection_type::get;
 	std::string name;
+	std::string password;
 	uint8_t password_hash[HASHLEN];
-	std::string answerstring;
+	std::atomic<login_state> login {login_state::idle};
+	page_writer_ptr answer;
 	struct MHD_PostProcessor *postprocessor;
 
 	bool name_flag = false;
@@ -37,14 +68,45 @@ struct connection_info_struct
 	int64_t price;
 	int64_t balance;
 	page_ref current_page;
+	route const* matched_route = nullptr;
+	// set while a POST waits for the tick which applies its command
+	command_ticket ticket;
+	std::chrono::steady_clock::time_point started;
 };
 
+/*
+
+Routes are registered once at startup and then frozen into a perfect hash table:
+lookup hashes the path once and compares a single candidate.
+
+*/
+
+void add_route(
+	http_method method,
+	std::string_view path,
+	route_handler handler,
+	MHD_PostDataIterator post_iterator = nullptr
+);
+void add_default_routes();
+void build_route_table();
+route const* find_route(http_method method, std::string_view path);
+
+// POST commands wait at most timeout for their tick, capacity bounds how many wait at once
+void start_command_waiting(std::chrono::milliseconds timeout, size_t capacity);
+
+// takes the rendered page without copying it, the writer returns to the pool when MHD frees the response
+MHD_Response* make_page_response(page_writer_ptr page);
+
 enum MHD_Result
 send_page_from_memory (
 	struct MHD_Connection *connection,
 	const char* page,
 	int status_code
 );
+MHD_Result reject_request(
+	struct MHD_Connection * connection,
+	request_status status
+);
 MHD_Result POST_request_transfer(
 	struct MHD_Connection * connection,
 	connection_info_struct * con_info
@@ -82,4 +144,17 @@ MHD_Result POST_request_gacha_one(
 MHD_Result POST_request_gacha_ten(
 	struct MHD_Connection * connection,
 	connection_info_struct * con_info
+);
+
+MHD_Result send_metrics_page(
+	struct MHD_Connection * connection
+);
+
+MHD_Result send_login_page(
+	struct MHD_Connection * connection
+);
+
+MHD_Result GET_main_page(
+	struct MHD_Connection * connection,
+	connection_info_struct * con_info
 );
\ No newline at end of file
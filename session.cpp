@@ -0,0 +1,99 @@
+#include "session.hpp"
+#include <sys/random.h>
+
+static size_t shard_of(std::string_view token) {
+	return session_hash{}(token) >> 60;
+}
+
+std::string generate_session_token() {
+	thread_local uint8_t pool[256];
+	thread_local size_t position = sizeof(pool);
+
+	std::string token;
+	token.reserve(SESSIONSIZE);
+	while (token.size() < SESSIONSIZE) {
+		if (position == sizeof(pool)) {
+			size_t filled = 0;
+			while (filled < sizeof(pool)) {
+				auto result = getrandom(pool + filled, sizeof(pool) - filled, 0);
+				if (result > 0) filled += result;
+			}
+			position = 0;
+		}
+		auto value = pool[position++];
+		// 234 is the largest multiple of 26 which fits: rejecting the rest keeps letters uniform
+		if (value < 234) {
+			token += (char)('A' + value % 26);
+		}
+	}
+	return token;
+}
+
+std::string session_store::create(dcon::user_id user) {
+	auto token = generate_session_token();
+	auto expires = clock::now() + time_to_live;
+
+	auto& owner = user_shards[user.index() % shard_count];
+	{
+		std::lock_guard<std::mutex> user_lock {owner.mtx};
+		auto previous = owner.tokens.find(user.index());
+		if (previous != owner.tokens.end()) {
+			auto& old_shard = token_shards[shard_of(previous->second)];
+			std::unique_lock<std::shared_mutex> lock {old_shard.mtx};
+			old_shard.sessions.erase(previous->second);
+		}
+		auto& target = token_shards[shard_of(token)];
+		{
+			std::unique_lock<std::shared_mutex> lock {target.mtx};
+			target.sessions[token] = {user, expires};
+		}
+		owner.tokens[user.index()] = token;
+	}
+
+	sweep_expired(sweep_position.fetch_add(1, std::memory_order_relaxed) % shard_count);
+	return token;
+}
+
+dcon::user_id session_store::find(std::string_view token) {
+	auto& shard = token_shards[shard_of(token)];
+	std::shared_lock<std::shared_mutex> lock {shard.mtx};
+	auto it = shard.sessions.find(token);
+	if (it == shard.sessions.end()) return {};
+	if (it->second.expires < clock::now()) return {};
+	return it->second.user;
+}
+
+void session_store::sweep_expired(size_t index) {
+	auto now = clock::now();
+	auto& shard = token_shards[index];
+	std::vector<std::pair<std::string, dcon::user_id>> expired;
+	{
+		std::unique_lock<std::shared_mutex> lock {shard.mtx};
+		for (auto& [token, item] : shard.sessions) {
+			if (item.expires < now) {
+				expired.emplace_back(token, item.user);
+			}
+		}
+		for (auto& [token, user] : expired) {
+			shard.sessions.erase(token);
+		}
+	}
+	// user shards are locked before token shards, so they are cleaned up after releasing it
+	for (auto& [token, user] : expired) {
+		auto& owner = user_shards[user.index() % shard_count];
+		std::lock_guard<std::mutex> user_lock {owner.mtx};
+		auto it = owner.tokens.find(user.index());
+		if (it != owner.tokens.end() && it->second == token) {
+			owner.tokens.erase(it);
+		}
+	}
+}
+
+size_t session_store::size() {
+	size_t result = 0;
+	for (auto& shard : token_shards) {
+		std::shared_lock<std::shared_mutex> lock {shard.mtx};
+		result += shard.sessions.size();
+	}
+	return result;
+}
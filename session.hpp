@@ -0,0 +1,65 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "data_ids.hpp"
+#include "unordered_dense.h"
+
+/*
+
+Session tokens are checked on every request, so lookups take only a shared lock
+on one shard and never copy the cookie.
+Logins write to two shards: one indexed by user to find the old token, one indexed by token.
+Sessions expire after a fixed time to live, expired entries are swept a shard at a time on login.
+
+*/
+
+#define SESSIONSIZE 64
+
+struct session_hash {
+	using is_transparent = void;
+	using is_avalanching = void;
+	uint64_t operator()(std::string_view token) const noexcept {
+		return ankerl::unordered_dense::hash<std::string_view>{}(token);
+	}
+};
+
+struct session_store {
+	static constexpr size_t shard_count = 16;
+	using clock = std::chrono::steady_clock;
+
+	struct session {
+		dcon::user_id user;
+		clock::time_point expires;
+	};
+
+	struct alignas(64) token_shard {
+		std::shared_mutex mtx;
+		ankerl::unordered_dense::map<std::string, session, session_hash, std::equal_to<>> sessions;
+	};
+
+	struct alignas(64) user_shard {
+		std::mutex mtx;
+		ankerl::unordered_dense::map<int32_t, std::string> tokens;
+	};
+
+	std::array<token_shard, shard_count> token_shards;
+	std::array<user_shard, shard_count> user_shards;
+	std::chrono::seconds time_to_live {7 * 24 * 60 * 60};
+	std::atomic<size_t> sweep_position {0};
+
+	// replaces the previous session of the user
+	std::string create(dcon::user_id user);
+	dcon::user_id find(std::string_view token);
+	void sweep_expired(size_t shard);
+	size_t size();
+};
+
+// letters from a per thread buffer refilled with getrandom
+std::string generate_session_token();
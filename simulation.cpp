@@ -1,33 +1,71 @@
+#include "alias_table.hpp"
+#include "command_log.hpp"
+#include "command_queue.hpp"
+#include "command_ticket.hpp"
 #include "constants.hpp"
+#include "counter_rng.hpp"
 #include "data.hpp"
 #include "data_ids.hpp"
+#include "html_writer.hpp"
+#include "inventory.hpp"
+#include "metrics.hpp"
+#include "text_store.hpp"
+#include "transfer_table.hpp"
 #include "unordered_dense.h"
 #include "url.hpp"
-#include "ve.hpp"
-#include "ve_avx2.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
 #include <cmath>
+#include <cstddef>
 #include <cstdint>
+#include <cstdio>
+#include <cstring>
 #include <fcntl.h>
+#include <format>
+#include <memory>
 #include <mutex>
+#include <optional>
+#include <oneapi/tbb/blocked_range.h>
 #include <oneapi/tbb/parallel_for.h>
+#include <queue>
 #include <random>
+#include <shared_mutex>
 #include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
 #include <vector>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
 #include "simulation.hpp"
 
 static dcon::data_container state {};
-
-std::mutex buildings_mutex;
-std::mutex gacha_mutex;
-std::mutex gacha_tickets_mutex;
-std::mutex savings_mutex;
-std::mutex storage_mutex;
-std::mutex user_mutex;
-std::mutex demand_mutex;
-std::mutex supply_mutex;
-std::mutex storage_values_mutex;
-std::mutex transfer_mutex;
+// stockpiles of storages live outside of the container, see inventory.hpp
+static inventory_table stockpiles;
+// edges of transfers, replaced by a new table whenever a transfer changes
+static std::shared_ptr<const transfer_table> transfers = std::make_shared<transfer_table>();
+
+metered_mutex buildings_mutex {"buildings"};
+metered_mutex gacha_mutex {"gacha"};
+metered_mutex gacha_tickets_mutex {"gacha_tickets"};
+metered_mutex savings_mutex {"savings"};
+metered_mutex storage_mutex {"storage"};
+metered_mutex user_mutex {"user"};
+metered_mutex demand_mutex {"demand"};
+metered_mutex supply_mutex {"supply"};
+metered_mutex storage_values_mutex {"storage_values"};
+metered_mutex transfer_mutex {"transfer"};
+// held for the whole tick and while users are created, so the log orders them exactly
+metered_mutex tick_mutex {"tick"};
+
+static command_log_writer world_log;
+// copy of the log which snapshots never truncate, kept to reproduce incidents offline
+static command_log_writer recording_log;
 
 static constexpr uint8_t max_inputs = 8;
 static constexpr uint8_t max_outputs = 8;
@@ -41,61 +79,323 @@ uint32_t pulls_count(dcon::user_id user) {
 }
 
 
-struct text_collection {
-	std::vector<char> text;
-	std::vector<uint32_t> word_start;
-	std::vector<uint32_t> word_length;
-	uint32_t available_key;
+ankerl::unordered_dense::map<std::string, dcon::user_id> name_to_user;
+// shared while logins look users up, exclusive while a user is created because that may move the user arrays
+static std::shared_mutex names_mutex;
+
+// keys of the text are stored in the container, the strings themselves never move
+text_store all_text;
+
+/*
+
+Views
+
+Pages are rendered from an immutable copy of the world published after every tick,
+so renderers never wait for the simulation and never see a half updated state.
+Readers keep their view alive while they render, the simulation reuses it once they are done.
+
+*/
+
+struct world_view {
+	dcon::data_container state;
+	inventory_table stockpiles;
+	std::shared_ptr<const transfer_table> transfers;
+	// per user: tick of the last change to the owned buildings or their activities
+	std::vector<uint64_t> ownership_version;
+	uint64_t tick = 0;
 };
 
-ankerl::unordered_dense::map<std::string, dcon::user_id> name_to_user;
+static std::atomic<std::shared_ptr<const world_view>> published_view;
+static std::shared_ptr<world_view> spare_view;
+static uint64_t current_tick = 0;
+static std::vector<uint64_t> ownership_revision;
+
+template<typename T>
+static void log_command(log_record_type type, T const& item) {
+	world_log.append(type, current_tick, item);
+	recording_log.append(type, current_tick, item);
+}
+
+// called during the tick, the change becomes visible with the view published at its end
+static void mark_ownership_changed(dcon::user_id user) {
+	if (ownership_revision.size() <= user.index()) {
+		ownership_revision.resize(user.index() + 1, 0);
+	}
+	ownership_revision[user.index()] = current_tick + 1;
+}
+
+void publish_view() {
+	std::shared_ptr<world_view> view;
+	if (spare_view && spare_view.use_count() == 1) {
+		view = std::move(spare_view);
+	} else {
+		view = std::make_shared<world_view>();
+	}
+
+	{
+		// users are created outside of the tick
+		std::lock(user_mutex, storage_mutex);
+		std::lock_guard<metered_mutex> lock (user_mutex, std::adopt_lock);
+		std::lock_guard<metered_mutex> lock2 (storage_mutex, std::adopt_lock);
+		view->state = state;
+		view->stockpiles = stockpiles;
+	}
+	view->transfers = transfers;
+	view->ownership_version = ownership_revision;
+	view->tick = current_tick;
+
+	auto previous = published_view.exchange(view, std::memory_order_acq_rel);
+	spare_view = std::const_pointer_cast<world_view>(previous);
+}
+
+std::shared_ptr<const world_view> acquire_view() {
+	return published_view.load(std::memory_order_acquire);
+}
+
+uint64_t view_tick(world_view const& view) {
+	return view.tick;
+}
 
-std::string get_text(text_collection& collection, uint32_t key) {
-	return std::string {collection.text.data() + collection.word_start[key]};
+bool view_has_user(world_view const& view, dcon::user_id user) {
+	return view.state.user_is_valid(user);
 }
 
-uint32_t new_text(text_collection& collection, std::string data) {
-	auto new_start = collection.text.size();
-	auto key = collection.available_key;
-	collection.text.resize(collection.text.size() + data.size() + 1);
-	std::copy(data.c_str(), data.c_str() + data.size(), collection.text.data() + new_start);
-	collection.word_start.push_back(new_start);
-	collection.word_length.push_back(data.size());
-	collection.available_key++;
-	return key;
+// building types and activities only change when the world is created or loaded,
+// seeded with the wall clock so versions from different runs don't collide
+static std::atomic<uint64_t> catalog_revision {0};
+
+static void mark_catalog_changed() {
+	auto now = std::chrono::system_clock::now().time_since_epoch();
+	catalog_revision.store(
+		std::max<uint64_t>(catalog_revision.load() + 1, std::chrono::duration_cast<std::chrono::seconds>(now).count())
+	);
+}
+
+uint64_t catalog_version() {
+	return catalog_revision.load(std::memory_order_relaxed);
+}
+
+uint32_t pulls_count(world_view const& view, dcon::user_id user) {
+	return view.state.user_get_development_tickets(user);
+}
+
+std::vector<dcon::building_id> retrieve_owned_buildings(world_view const& view, dcon::user_id user) {
+	std::vector<dcon::building_id> result;
+	view.state.user_for_each_ownership(user, [&](auto ownership){
+		result.push_back(view.state.ownership_get_owned(ownership));
+	});
+	return result;
+}
+
+dcon::storage_id retrieve_building_storage(world_view const& view, dcon::building_id building) {
+	return view.state.building_get_storage(building);
 }
 
-text_collection all_text {};
+dcon::storage_id retrieve_user_storage(world_view const& view, dcon::user_id user) {
+	return view.state.user_get_storage(user);
+}
+
+/*
+
+Market
+
+Every commodity keeps its own book of open orders.
+Bids are ordered by the highest price, asks by the lowest one,
+ties are broken by the order of arrival.
+
+*/
+
+template<typename ID>
+struct order_entry {
+	__uint128_t price;
+	uint64_t sequence;
+	ID id;
+};
+
+struct bid_priority {
+	bool operator()(order_entry<dcon::demand_id> const& a, order_entry<dcon::demand_id> const& b) const {
+		if (a.price != b.price) return a.price < b.price;
+		return a.sequence > b.sequence;
+	}
+};
+
+struct ask_priority {
+	bool operator()(order_entry<dcon::supply_id> const& a, order_entry<dcon::supply_id> const& b) const {
+		if (a.price != b.price) return a.price > b.price;
+		return a.sequence > b.sequence;
+	}
+};
+
+struct settlement {
+	dcon::user_id user;
+	__uint128_t amount;
+};
+
+struct delivery {
+	dcon::storage_id storage;
+	int32_t amount;
+};
+
+struct order_book {
+	std::priority_queue<order_entry<dcon::demand_id>, std::vector<order_entry<dcon::demand_id>>, bid_priority> bids;
+	std::priority_queue<order_entry<dcon::supply_id>, std::vector<order_entry<dcon::supply_id>>, ask_priority> asks;
+
+	// results of matching which touch shared data are applied after the parallel pass
+	std::vector<settlement> settlements;
+	std::vector<delivery> deliveries;
+	std::vector<dcon::demand_id> filled_demands;
+	std::vector<dcon::supply_id> filled_supplies;
+};
+
+static std::vector<order_book> order_books;
+// the next order gets it, saved with snapshots as well as the sequence of every order
+static uint64_t order_sequence = 0;
+
+// orders keep their sequence, so books rebuilt after a restart break ties the same way
+static void restore_to_order_book(dcon::demand_id demand) {
+	auto cid = state.demand_get_cid(demand);
+	order_books[cid.index()].bids.push({state.demand_get_price(demand), state.demand_get_sequence(demand), demand});
+}
+
+static void restore_to_order_book(dcon::supply_id supply) {
+	auto cid = state.supply_get_cid(supply);
+	order_books[cid.index()].asks.push({state.supply_get_price(supply), state.supply_get_sequence(supply), supply});
+}
+
+void add_to_order_book(dcon::demand_id demand) {
+	state.demand_set_sequence(demand, order_sequence++);
+	restore_to_order_book(demand);
+}
+
+void add_to_order_book(dcon::supply_id supply) {
+	state.supply_set_sequence(supply, order_sequence++);
+	restore_to_order_book(supply);
+}
+
+// Touches only orders of the given commodity, so books can be matched in parallel.
+void match_orders(dcon::commodity_id cid, order_book& book) {
+	book.settlements.clear();
+	book.deliveries.clear();
+	book.filled_demands.clear();
+	book.filled_supplies.clear();
+
+	while (!book.bids.empty() && !book.asks.empty()) {
+		auto& bid = book.bids.top();
+		auto& ask = book.asks.top();
+		if (bid.price < ask.price) break;
+
+		auto demand = bid.id;
+		auto supply = ask.id;
+		auto wanted = state.demand_get_volume(demand);
+		auto offered = state.supply_get_storage(supply);
+		auto volume = wanted < offered ? wanted : offered;
+
+		// the order which was resting in the book sets the price
+		auto price = bid.sequence < ask.sequence ? bid.price : ask.price;
+
+		auto buyer = state.demand_get_owner_from_demand_ownership(demand);
+		auto seller = state.supply_get_owner_from_supply_ownership(supply);
+
+		if (buyer) {
+			// inventories of storages are shared between commodities
+			book.deliveries.push_back({state.user_get_storage(buyer), (int32_t)volume});
+			// wealth was escrowed at the bid price
+			if (bid.price > price) {
+				book.settlements.push_back({buyer, (bid.price - price) * volume});
+			}
+		}
+		if (seller) {
+			book.settlements.push_back({seller, price * volume});
+		}
+
+		state.demand_set_volume(demand, wanted - volume);
+		state.supply_set_storage(supply, offered - volume);
+
+		if (wanted == volume) {
+			book.filled_demands.push_back(demand);
+			book.bids.pop();
+		}
+		if (offered == volume) {
+			book.filled_supplies.push_back(supply);
+			book.asks.pop();
+		}
+	}
+}
+
+// every random draw of the world derives from it, it is saved with the snapshot and logged with ticks
+static uint64_t world_seed = 0;
+
+static uint64_t fresh_world_seed() {
+	std::random_device device;
+	return ((uint64_t)device() << 32) | device();
+}
+
+/*
+
+Gacha
+
+Draws go through an alias table over building types, rebuilt only when a weight changes.
+
+*/
+
+static alias_table gacha_sampler;
+static bool gacha_sampler_dirty = true;
+
+// every change of gacha weights has to go through here to reach the sampler
+static void set_gacha_weight(dcon::building_type_id btid, float weight) {
+	state.building_type_set_gacha_weight(btid, weight);
+	gacha_sampler_dirty = true;
+}
+
+static void rebuild_gacha_sampler() {
+	std::vector<float> weights(state.building_type_size(), 0.f);
+	state.for_each_building_type([&](auto btid){
+		weights[btid.index()] = state.building_type_get_gacha_weight(btid);
+	});
+	gacha_sampler.build(weights);
+	gacha_sampler_dirty = false;
+}
+
+static dcon::building_type_id draw_building_type(random_stream& engine) {
+	if (gacha_sampler_dirty) {
+		rebuild_gacha_sampler();
+	}
+	if (gacha_sampler.empty()) {
+		return {};
+	}
+	return dcon::building_type_id {(dcon::building_type_id::value_base_t)gacha_sampler.sample(engine)};
+}
 
 void init_simulation() {
+	world_seed = fresh_world_seed();
 	state.user_resize_pwd_hash(HASHLEN);
 
 	{
 		// commodities
 
 		auto ore_basic = state.create_commodity();
-		state.commodity_set_name(ore_basic, new_text(all_text, "Basic ore"));
+		state.commodity_set_name(ore_basic, all_text.intern("Basic ore"));
 		state.commodity_set_inversed_density(ore_basic, 125);
 
 		auto fuel_basic = state.create_commodity();
-		state.commodity_set_name(fuel_basic, new_text(all_text, "Basic fuel"));
+		state.commodity_set_name(fuel_basic, all_text.intern("Basic fuel"));
 		state.commodity_set_inversed_density(fuel_basic, 1000);
 
 		auto material_basic = state.create_commodity();
-		state.commodity_set_name(material_basic, new_text(all_text, "Basic material"));
+		state.commodity_set_name(material_basic, all_text.intern("Basic material"));
 		state.commodity_set_inversed_density(material_basic, 100);
 
 		auto ore_basic_source  = state.create_commodity();
-		state.commodity_set_name(ore_basic_source, new_text(all_text, "Basic ore vein"));
+		state.commodity_set_name(ore_basic_source, all_text.intern("Basic ore vein"));
 		state.commodity_set_inversed_density(ore_basic_source, 125);
 
 		auto fuel_basic_source  = state.create_commodity();
-		state.commodity_set_name(fuel_basic_source, new_text(all_text, "Basic fuel source"));
+		state.commodity_set_name(fuel_basic_source, all_text.intern("Basic fuel source"));
 		state.commodity_set_inversed_density(fuel_basic_source, 125);
 
-		state.storage_resize_current(state.commodity_size());
-		state.storage_resize_limit(state.commodity_size());
-		state.transfer_resize_current(state.commodity_size());
+		order_books.resize(state.commodity_size());
+
+		stockpiles.resize(state.storage_size(), state.commodity_size());
 		state.activity_resize_input(max_inputs);
 		state.activity_resize_input_amount(max_inputs);
 		state.activity_resize_output(max_outputs);
@@ -106,19 +406,19 @@ void init_simulation() {
 		// buildings and activities
 
 		auto provide_ore = state.create_activity();
-		state.activity_set_name(provide_ore, new_text(all_text, "Ore source"));
+		state.activity_set_name(provide_ore, all_text.intern("Ore source"));
 		state.activity_set_output(provide_ore, 0, ore_basic_source);
 		state.activity_set_output_amount(provide_ore, 0, 1);
 
 		auto extract_basic = state.create_activity();
-		state.activity_set_name(extract_basic, new_text(all_text, "Extract basic ore"));
+		state.activity_set_name(extract_basic, all_text.intern("Extract basic ore"));
 		state.activity_set_input(extract_basic, 0, ore_basic_source);
 		state.activity_set_input_amount(extract_basic, 0, 1);
 		state.activity_set_output(extract_basic, 0, ore_basic);
 		state.activity_set_output_amount(extract_basic, 0, 1);
 
 		auto refine_basic = state.create_activity();
-		state.activity_set_name(refine_basic, new_text(all_text, "Refine basic ore"));
+		state.activity_set_name(refine_basic, all_text.intern("Refine basic ore"));
 		state.activity_set_input(refine_basic, 0, ore_basic);
 		state.activity_set_input_amount(refine_basic, 0, 1);
 		state.activity_set_output(refine_basic, 0, material_basic);
@@ -127,20 +427,20 @@ void init_simulation() {
 		state.building_type_resize_activities(max_activities);
 
 		auto ore_vein = state.create_building_type();
-		state.building_type_set_name(ore_vein, new_text(all_text, "Ore vein"));
+		state.building_type_set_name(ore_vein, all_text.intern("Ore vein"));
 		state.building_type_set_activities(ore_vein, 0, provide_ore);
 		state.building_type_set_can_be_constructed(ore_vein, false);
-		state.building_type_set_gacha_weight(ore_vein, 10.f);
+		set_gacha_weight(ore_vein, 10.f);
 
 		auto extractor = state.create_building_type();
-		state.building_type_set_name(extractor, new_text(all_text, "Extractor"));
+		state.building_type_set_name(extractor, all_text.intern("Extractor"));
 		state.building_type_set_activities(extractor, 0, extract_basic);
 		state.building_type_set_construction(extractor, 0, ore_basic);
 		state.building_type_set_construction_amount(extractor, 0, 10);
 		state.building_type_set_can_be_constructed(extractor, true);
 
 		auto refinery = state.create_building_type();
-		state.building_type_set_name(refinery, new_text(all_text, "Refinery"));
+		state.building_type_set_name(refinery, all_text.intern("Refinery"));
 		state.building_type_set_activities(refinery, 0, refine_basic);
 		state.building_type_set_construction(refinery, 0, ore_basic);
 		state.building_type_set_construction_amount(refinery, 0, 50);
@@ -151,479 +451,529 @@ void init_simulation() {
 		state.supply_set_cid(fake_supply, ore_basic);
 		state.supply_set_storage(fake_supply, 1000);
 		state.supply_set_price(fake_supply, 50);
+		add_to_order_book(fake_supply);
 	}
+
+	mark_catalog_changed();
+	publish_view();
 }
 
-std::string to_string(__uint128_t value) {
-	std::string representation {};
-	for (int i = 0; i < 129 * std::log10(2); i++) {
-		auto digit =  (uint8_t) (value % 10);
-		value = value / 10;
-		representation = std::to_string(digit) + representation;
-		if (value == 0) {
-			break;
-		}
-	}
-	return  representation;
+void retrieve_balance(html_writer& out, world_view const& view, dcon::user_id user) {
+	out.number(view.state.user_get_wealth(user));
 }
 
-std::string retrieve_balance(dcon::user_id user) {
-	savings_mutex.lock();
-	auto savings = state.user_get_wealth(user);
-	savings_mutex.unlock();
-	return to_string(savings);
+void retrieve_user_name(html_writer& out, world_view const& view, dcon::user_id user){
+	out.raw(all_text.escaped(view.state.user_get_name(user)));
 }
 
+struct user_record {
+	char name[MAXNAMESIZE];
+	uint8_t password_hash[HASHLEN];
+};
+
+// empty when the name can't be stored
+static dcon::user_id create_user(std::string const& name, uint8_t const password_hash[HASHLEN]) {
+	auto name_key = all_text.intern(name);
+	if (name_key == text_store::no_key) return {};
+
+	std::unique_lock<std::shared_mutex> names_lock {names_mutex};
+	std::lock(user_mutex, storage_mutex);
+	std::lock_guard<metered_mutex> lock (user_mutex, std::adopt_lock);
+	std::lock_guard<metered_mutex> lock2 (storage_mutex, std::adopt_lock);
+
+	auto user = state.create_user();
+	name_to_user[name] = user;
+	state.user_set_name(user, name_key);
 
-std::string retrieve_user_name(dcon::user_id user){
-	return get_text(all_text, state.user_get_name(user));
+	for (uint8_t i = 0; i < HASHLEN; i++) {
+		state.user_set_pwd_hash(user, i, password_hash[i]);
+	}
+	state.user_set_wealth(user, 1000);
+	state.user_set_development_tickets(user, 10);
+
+	auto storage = state.create_storage();
+	state.storage_set_owner(storage, user);
+	state.user_set_storage(user, storage);
+
+	return user;
+}
+
+static dcon::user_id check_password(dcon::user_id user, uint8_t const password_hash[HASHLEN]) {
+	bool hash_equal = true;
+	for (uint8_t i = 0; i < HASHLEN; i++) {
+		hash_equal = hash_equal && state.user_get_pwd_hash(user, i) == password_hash[i];
+	}
+
+	if (hash_equal) {
+		return user;
+	} else {
+		return dcon::user_id{};
+	}
 }
 
 dcon::user_id create_or_get_user(std::string name, uint8_t password_hash[HASHLEN]) {
+	{
+		std::shared_lock<std::shared_mutex> lock {names_mutex};
+		auto it = name_to_user.find(name);
+		if (it != name_to_user.end()) return check_password(it->second, password_hash);
+	}
+
+	// users are only created under the tick lock, so nobody changes the names while it is held
+	std::lock_guard<metered_mutex> lock {tick_mutex};
 	auto it = name_to_user.find(name);
-	if (it == name_to_user.end()) {
-		user_mutex.lock();
-		storage_mutex.lock();
-		auto user = state.create_user();
-		name_to_user[name] = user;
-		state.user_set_name(user, new_text(all_text, name));
+	if (it != name_to_user.end()) return check_password(it->second, password_hash);
 
-		for (uint8_t i = 0; i < HASHLEN; i++) {
-			state.user_set_pwd_hash(user, i, password_hash[i]);
-		}
-		state.user_set_wealth(user, 1000);
-		state.user_set_development_tickets(user, 10);
+	auto user = create_user(name, password_hash);
+	if (!user) return user;
 
-		auto storage = state.create_storage();
-		state.storage_set_owner(storage, user);
-		state.user_set_storage(user, storage);
+	user_record record {};
+	memcpy(record.name, name.data(), std::min(name.size(), MAXNAMESIZE - 1));
+	memcpy(record.password_hash, password_hash, HASHLEN);
+	log_command(log_record_type::user, record);
 
-		user_mutex.unlock();
-		storage_mutex.unlock();
-		return user;
+	return user;
+}
+
+void building_name(html_writer& out, world_view const& view, dcon::building_id bid) {
+	auto const& state = view.state;
+	auto btid = state.building_get_building_type(bid);
+	auto activity = state.building_get_activity(bid);
+	out.raw(all_text.escaped(state.building_type_get_name(btid)));
+	out.integer(bid.index());
+	if (activity) {
+		out.raw("(").raw(all_text.escaped(state.activity_get_name(activity))).raw(")");
 	} else {
-		auto user = it->second;
+		out.raw("(Idle)");
+	}
+}
+void building_link(html_writer& out, world_view const& view, dcon::building_id bid) {
+	out.raw("<a href=\"").url(url_path::building, bid.index()).raw("\">");
+	building_name(out, view, bid);
+	out.raw("</a>");
+}
 
-		bool hash_equal = true;
-		for (uint8_t i = 0; i < HASHLEN; i++) {
-			hash_equal = hash_equal && state.user_get_pwd_hash(user, i) == password_hash[i];
-		}
+/*
 
-		if (hash_equal) {
-			return user;
-		} else {
-			return dcon::user_id{};
-		}
+Fragments
+
+Option lists repeat across pages and within one page,
+so they are rendered once per version and spliced into pages by reference.
+
+*/
+
+struct cached_fragment {
+	uint64_t version = 0;
+	shared_fragment bytes;
+};
+
+static metered_mutex fragments_mutex {"fragments"};
+static cached_fragment commodity_options_fragment;
+static ankerl::unordered_dense::map<int32_t, cached_fragment> storage_options_fragments;
+
+template<typename Render>
+static shared_fragment render_fragment(Render&& render) {
+	auto writer = make_page_writer();
+	render(*writer);
+	return std::make_shared<std::string const>(writer->str());
+}
+
+// renders outside of the lock, a racing render of the same version is simply dropped;
+// slots are found under the lock every time because map entries move when it grows
+template<typename Find, typename Render>
+static shared_fragment cached_or_render(Find&& find_slot, uint64_t version, Render&& render) {
+	{
+		std::lock_guard<metered_mutex> lock {fragments_mutex};
+		cached_fragment& slot = find_slot();
+		if (slot.bytes && slot.version == version) return slot.bytes;
+	}
+	auto bytes = render_fragment(render);
+	std::lock_guard<metered_mutex> lock {fragments_mutex};
+	cached_fragment& slot = find_slot();
+	if (!slot.bytes || slot.version < version) {
+		slot = {version, bytes};
 	}
+	return bytes;
 }
 
-std::string building_name(dcon::building_id bid) {
-	auto btid = state.building_get_building_type(bid);
-	auto activity = state.building_get_activity(bid);
-	std::string activity_string = "(Idle)";
-	if (activity)
-		activity_string =
-		"("
-		+ get_text(all_text, state.activity_get_name(activity))
-		+ ")";
-	return get_text(all_text, state.building_type_get_name(btid))
-		+ std::to_string(bid.index())
-		+ activity_string;
-}
-std::string building_link(dcon::building_id bid) {
-	return "<a href=\"" + url_gen::building(bid.index()) + "\">" + building_name(bid) + "</a>";
-}
-
-std::string retrieve_user_report_body(dcon::user_id user) {
-	std::string result;
-	result += "<h2>Balance</h2>";
-	result += "<p>Savings: " + retrieve_balance(user) + "</p>";
-
-
-	result += "<p>Development Tickets: " + std::to_string(pulls_count(user)) + "</p>";
-	result += "<a href=\"" + url_gen::gacha_page() + "\">Use tickets</a>";
-
-	result += "<h2>Stockpiles</h2>";
-	result += "<ul>";
-	state.for_each_commodity([&](auto cid){
-		result += "<li>";
-		result += get_text(all_text, state.commodity_get_name(cid));
-		result += " ";
-		result += std::to_string(state.storage_get_current(state.user_get_storage(user), cid));
-		result += "</li>";
+static void commodity_options(html_writer& out, world_view const& view) {
+	auto const& state = view.state;
+	auto find_slot = [&]() -> cached_fragment& {
+		return commodity_options_fragment;
+	};
+	out.splice(cached_or_render(find_slot, catalog_version(), [&](html_writer& fragment) {
+		state.for_each_commodity([&](auto cid) {
+			fragment.raw("<option value=\"").integer(cid.index()).raw("\">");
+			fragment.raw(all_text.escaped(state.commodity_get_name(cid)));
+			fragment.raw("</option>");
+		});
+	}));
+}
+
+void retrieve_user_report_body(html_writer& out, world_view const& view, dcon::user_id user) {
+	auto const& state = view.state;
+	out.raw("<h2>Balance</h2>");
+	out.raw("<p>Savings: ");
+	retrieve_balance(out, view, user);
+	out.raw("</p>");
+
+
+	out.raw("<p>Development Tickets: ").integer(pulls_count(view, user)).raw("</p>");
+	out.raw("<a href=\"").url(url_path::gacha_page).raw("\">Use tickets</a>");
+
+	out.raw("<h2>Stockpiles</h2>");
+	out.raw("<ul>");
+	view.stockpiles.for_each(state.user_get_storage(user), [&](auto cid, int32_t amount){
+		out.raw("<li>");
+		out.raw(all_text.escaped(state.commodity_get_name(cid)));
+		out.raw(" ");
+		out.integer(amount);
+		out.raw("</li>");
 	});
-	result += "</ul>";
+	out.raw("</ul>");
 
-	result += "<h2>Ownership</h2>";
+	out.raw("<h2>Ownership</h2>");
 	bool owns_buildings = false;
-	result += "<ul>";
+	out.raw("<ul>");
 	state.user_for_each_ownership(user, [&](dcon::ownership_id ownership){
 		owns_buildings = true;
 		auto building = state.ownership_get_owned(ownership);
-		auto building_type = state.building_get_building_type(building);
-		auto activity = state.building_get_activity(building);
-		std::string activity_string = "(Idle)";
-		if (activity)
-			activity_string =
-			"("
-			+ get_text(all_text, state.activity_get_name(activity))
-			+ ")";
-		result += "<li>" + building_link(building) + "</li>";
+		out.raw("<li>");
+		building_link(out, view, building);
+		out.raw("</li>");
 	});
-	result += "</ul>";
+	out.raw("</ul>");
 
 	if (!owns_buildings) {
-		result += "None";
+		out.raw("None");
 	}
-
-	return result;
 }
 
-std::string retrieve_building_type_list() {
-	std::string result;
-	result += "<ul>";
+void retrieve_building_type_list(html_writer& out, world_view const& view) {
+	auto const& state = view.state;
+	out.raw("<ul>");
 	state.for_each_building_type([&](auto btid){
-		result += "<li><a href=\"" + url_gen::building_type(btid.index()) + "\">" + get_text(all_text, state.building_type_get_name(btid)) + "</a></li>";
+		out.raw("<li><a href=\"").url(url_path::building_type, btid.index()).raw("\">");
+		out.raw(all_text.escaped(state.building_type_get_name(btid)));
+		out.raw("</a></li>");
 	});
-	result += "</ul>";
-
-	return result;
+	out.raw("</ul>");
 }
 
-std::string navigation_header() {
-	return "<header><h1>Navigation</h1><ul><li>Go <a href=\"" + url_gen::main_mage() + "\">back to main page</a></li></ul></header>";
+void navigation_header(html_writer& out) {
+	out.raw("<header><h1>Navigation</h1><ul><li>Go <a href=\"").url(url_path::main_page).raw("\">back to main page</a></li></ul></header>");
 }
 
-std::string footer() {
-	const auto now = std::chrono::system_clock::now();
-	auto time_string = std::format("{:%Y-%m-%d %H:%M}", now);
-	return  "<footer> Report generated at <time>" + time_string + "</time> </footer>";
-}
+void trade_section(html_writer& out, world_view const& view, dcon::user_id user) {
+	auto const& state = view.state;
+	out.raw("<h2>Your trade</h2>");
 
-std::string trade_section(dcon::user_id user) {
-	std::string result = "";
-	result += "<h2>Your trade</h2>";
-
-	result += "<h3>Your orders</h3>";
-	result += "<table><caption>Demand</caption><thead><tr><th scope=\"col\">Commodity</th><th scope=\"col\">Price</th><th scope=\"col\">Details</th></tr></thead>";
+	out.raw("<h3>Your orders</h3>");
+	out.raw("<table><caption>Demand</caption><thead><tr><th scope=\"col\">Commodity</th><th scope=\"col\">Price</th><th scope=\"col\">Details</th></tr></thead>");
 	state.user_for_each_demand_ownership_as_owner(user, [&](auto o){
 		dcon::demand_id demand = state.demand_ownership_get_demand(o);
 
 		auto cid = state.demand_get_cid(demand);
 		auto price = state.demand_get_price(demand);
-		result +="<tr><td>";
-		result += get_text(all_text, state.commodity_get_name(cid));
-		result += "</td><td>";
-		result += to_string(price);
-		result += "</td><td>";
-		result += "<a href=\"" + url_gen::demand(demand.index()) + "\">Details</a>";
-		result += "</td></tr>";
-	});
-	result += "</table>";
-
-	result += "<form action=\"" + url_gen::new_demand() + "\" method=\"post\">";
-	result += "<p><input type=\"number\" min=\"1\" name=\"volume\" id=\"volume_demand\">";
-	result += "<label for=\"volume_demand\">Demanded volume</label></p>";
-	result += "<p><input type=\"number\" min=\"1\" name=\"price\" id=\"price_demand\">";
-	result += "<label for=\"price_demand\">Price per unit</label></p>";
-	result += "<select name=\"cid\" id=\"commodity_select\">";
-	state.for_each_commodity([&](auto cid) {
-		result += "<option value=\"" + std::to_string(cid.index()) +  "\">" + get_text(all_text, state.commodity_get_name(cid)) + "</option>";
+		out.raw("<tr><td>");
+		out.raw(all_text.escaped(state.commodity_get_name(cid)));
+		out.raw("</td><td>");
+		out.number(price);
+		out.raw("</td><td>");
+		out.raw("<a href=\"").url(url_path::demand, demand.index()).raw("\">Details</a>");
+		out.raw("</td></tr>");
 	});
-	result += "</select></p>";
-	result += "<p><button type=\"submit\">Submit</button></p>";
-	result += "</form>";
-
-	result += "<table><caption>Supply</caption><thead><tr><th scope=\"col\">Commodity</th><th scope=\"col\">Price</th><th scope=\"col\">Details</th></tr></thead>";
+	out.raw("</table>");
+
+	out.raw("<form action=\"").url(url_path::new_demand).raw("\" method=\"post\">");
+	out.raw("<p><input type=\"number\" min=\"1\" name=\"volume\" id=\"volume_demand\">");
+	out.raw("<label for=\"volume_demand\">Demanded volume</label></p>");
+	out.raw("<p><input type=\"number\" min=\"1\" name=\"price\" id=\"price_demand\">");
+	out.raw("<label for=\"price_demand\">Price per unit</label></p>");
+	out.raw("<select name=\"cid\" id=\"commodity_select\">");
+	commodity_options(out, view);
+	out.raw("</select></p>");
+	out.raw("<p><button type=\"submit\">Submit</button></p>");
+	out.raw("</form>");
+
+	out.raw("<table><caption>Supply</caption><thead><tr><th scope=\"col\">Commodity</th><th scope=\"col\">Price</th><th scope=\"col\">Details</th></tr></thead>");
 	state.user_for_each_supply_ownership_as_owner(user, [&](auto o){
 		dcon::supply_id supply = state.supply_ownership_get_supply(o);
 
 		auto cid = state.supply_get_cid(supply);
 		auto price = state.supply_get_price(supply);
-		result +="<tr><td>";
-		result += get_text(all_text, state.commodity_get_name(cid));
-		result += "</td><td>";
-		result += to_string(price);
-		result += "</td><td>";
-		result += "<a href=\"" + url_gen::supply(supply.index()) + "\">Details</a>";
-		result += "</td></tr>";
+		out.raw("<tr><td>");
+		out.raw(all_text.escaped(state.commodity_get_name(cid)));
+		out.raw("</td><td>");
+		out.number(price);
+		out.raw("</td><td>");
+		out.raw("<a href=\"").url(url_path::supply, supply.index()).raw("\">Details</a>");
+		out.raw("</td></tr>");
 	});
-	result += "</table>";
-
-	result += "<form action=\"" + url_gen::new_supply() + "\" method=\"post\">";
-	result += "<p><input type=\"number\" min=\"1\" name=\"volume\" id=\"volume_supply\">";
-	result += "<label for=\"volume_supply\">Supplied volume</label></p>";
-	result += "<p><input type=\"number\" min=\"1\" name=\"price\" id=\"price_supply\">";
-	result += "<label for=\"price_supply\">Price per unit</label></p>";
-	result += "<select name=\"cid\" id=\"commodity_select\">";
-	state.for_each_commodity([&](auto cid) {
-		result += "<option value=\"" + std::to_string(cid.index()) +  "\">" + get_text(all_text, state.commodity_get_name(cid)) + "</option>";
-	});
-	result += "</select></p>";
-	result += "<p><button type=\"submit\">Submit</button></p>";
-	result += "</form>";
+	out.raw("</table>");
+
+	out.raw("<form action=\"").url(url_path::new_supply).raw("\" method=\"post\">");
+	out.raw("<p><input type=\"number\" min=\"1\" name=\"volume\" id=\"volume_supply\">");
+	out.raw("<label for=\"volume_supply\">Supplied volume</label></p>");
+	out.raw("<p><input type=\"number\" min=\"1\" name=\"price\" id=\"price_supply\">");
+	out.raw("<label for=\"price_supply\">Price per unit</label></p>");
+	out.raw("<select name=\"cid\" id=\"commodity_select\">");
+	commodity_options(out, view);
+	out.raw("</select></p>");
+	out.raw("<p><button type=\"submit\">Submit</button></p>");
+	out.raw("</form>");
+}
 
-	return result;
+static void storage_options(html_writer& out, world_view const& view, dcon::user_id owner) {
+	auto const& state = view.state;
+	auto version = owner.index() < view.ownership_version.size() ? view.ownership_version[owner.index()] : 0;
+	auto find_slot = [&]() -> cached_fragment& {
+		return storage_options_fragments[owner.index()];
+	};
+	auto render = [&](html_writer& fragment) {
+		fragment.raw("<option value=\"").integer(state.user_get_storage(owner).id.index()).raw("\">Personal storage</option>");
+		state.user_for_each_ownership(owner, [&](auto o) {
+			auto attached = state.ownership_get_owned(o);
+			auto source = state.building_get_storage(attached);
+			fragment.raw("<option value=\"").integer(source.id.index()).raw("\">");
+			building_name(fragment, view, attached);
+			fragment.raw("</option>");
+		});
+	};
+	out.splice(cached_or_render(find_slot, version, render));
 }
 
-std::string make_building_report(dcon::building_id bid) {
+static void transfer_row(html_writer& out, world_view const& view, transfer_edge const& edge, dcon::storage_id other, const char* direction) {
+	auto const& state = view.state;
+	out.raw("<li>");
+	out.integer(edge.volume);
+	out.raw(" ");
+	out.raw(all_text.escaped(state.commodity_get_name(edge.cid)));
+	out.raw(direction);
+	auto attached_to = state.storage_get_attached_to(other);
+	if (attached_to) {
+		building_link(out, view, attached_to);
+	} else {
+		out.raw("Personal storage");
+	}
+	out.raw("</li>");
+}
+
+void make_building_report(html_writer& out, dcon::building_id bid) {
+	auto current_view = acquire_view();
+	auto const& view = *current_view;
+	auto const& state = view.state;
+
 	if(!state.building_is_valid(bid)) {
-		return "<html><head><title>Error</title></head><body>Invalid id</body></html>";
+		out.raw("<html><head><title>Error</title></head><body>Invalid id</body></html>");
+		return;
 	}
 
 	auto owner = state.building_get_owner_from_ownership(bid);
 
 	auto btid = state.building_get_building_type(bid);
 	auto activity = state.building_get_activity(bid);
-	auto activity_string = activity ? get_text(all_text, state.activity_get_name(activity)) : "";
 	auto storage = state.building_get_storage(bid);
-	std::string result =
-		"<html><head><title>" + building_name(bid) + "</title></head>";
+	out.raw("<html><head><title>");
+	building_name(out, view, bid);
+	out.raw("</title></head>");
 
 
-	result += "<body>";
+	out.raw("<body>");
 
-	result += navigation_header();
+	navigation_header(out);
 
-	result += "<h1>" + building_name(bid) + "</h1>";
-	result += "Current action: " + (activity ? activity_string : "None");
+	out.raw("<h1>");
+	building_name(out, view, bid);
+	out.raw("</h1>");
+	out.raw("Current action: ");
+	if (activity) {
+		out.raw(all_text.escaped(state.activity_get_name(activity)));
+	} else {
+		out.raw("None");
+	}
 
 
-	result += "<h2>Incoming transfers</h2>";
+	out.raw("<h2>Incoming transfers</h2>");
 	bool any_incoming = false;
-	result += "<ul>";
-	state.storage_for_each_transfer_as_target(storage, [&](auto t){
-		state.for_each_commodity([&](auto cid){
-			if (state.transfer_get_current(t, cid) == 0) return;
-			any_incoming = true;
-			result += "<li>";
-			result += std::to_string(state.transfer_get_current(t, cid));
-			result += " ";
-			result += get_text(all_text, state.commodity_get_name(cid));
-			auto source = state.transfer_get_source(t);
-			auto attached_to = state.storage_get_attached_to(source);
-			result += " from ";
-			if (attached_to) {
-				result += building_link(attached_to);
-			} else {
-				result += "Personal storage";
-			}
-			result += "</li>";
-		});
+	out.raw("<ul>");
+	view.transfers->for_each_incoming(storage, [&](transfer_edge const& edge){
+		any_incoming = true;
+		transfer_row(out, view, edge, edge.source, " from ");
 	});
-	result += "</ul>";
+	out.raw("</ul>");
 	if (!any_incoming) {
-		result += "None";
-	}
-
-	result += "<h3>Set up incoming transfer</h3>";
-	result += "<form action=\"" + url_gen::set_transfer() + "\" method=\"post\">";
-	result += "<input name=\"id2\" type=\"hidden\" value=\"" + std::to_string(storage.id.index()) + "\">";
-	result += "<p><label for=\"source_storage_select\">Select source storage</label><br>";
-	result += "<select name=\"id\" id=\"source_storage_select\">";
-	result += "<option value=\"" + std::to_string(state.user_get_storage(owner).id.index()) +  "\">Personal storage</option>";
-	state.user_for_each_ownership(owner, [&](auto o) {
-		auto attached = state.ownership_get_owned(o);
-		auto source = state.building_get_storage(attached);
-		result += "<option value=\"" + std::to_string(source.id.index()) +  "\">" + building_name(attached) + "</option>";
-	});
-	result += "</select></p>";
+		out.raw("None");
+	}
 
-	result += "<select name=\"id3\" id=\"commodity_select\">";
-	state.for_each_commodity([&](auto cid) {
-		result += "<option value=\"" + std::to_string(cid.index()) +  "\">" + get_text(all_text, state.commodity_get_name(cid)) + "</option>";
-	});
-	result += "</select></p>";
+	out.raw("<h3>Set up incoming transfer</h3>");
+	out.raw("<form action=\"").url(url_path::set_transfer).raw("\" method=\"post\">");
+	out.raw("<input name=\"id2\" type=\"hidden\" value=\"").integer(storage.id.index()).raw("\">");
+	out.raw("<p><label for=\"source_storage_select\">Select source storage</label><br>");
+	out.raw("<select name=\"id\" id=\"source_storage_select\">");
+	storage_options(out, view, owner);
+	out.raw("</select></p>");
+
+	out.raw("<select name=\"id3\" id=\"commodity_select\">");
+	commodity_options(out, view);
+	out.raw("</select></p>");
 
-	result += "<p><label for=\"volume\">Volume</label><br>";
-	result += "<input type=\"number\" id=\"volume\" name=\"volume\" min=\"0\" max=\"3\" /></p>";
+	out.raw("<p><label for=\"volume\">Volume</label><br>");
+	out.raw("<input type=\"number\" id=\"volume\" name=\"volume\" min=\"0\" max=\"3\" /></p>");
 
-	result += "<p><button type=\"submit\">Request transfer change</button></p>";
-	result += "</form>";
+	out.raw("<p><button type=\"submit\">Request transfer change</button></p>");
+	out.raw("</form>");
 
-	result += "<h2>Outgoing transfers</h2>";
+	out.raw("<h2>Outgoing transfers</h2>");
 	bool any_outgoing = false;
-	result += "<ul>";
-	state.storage_for_each_transfer_as_source(storage, [&](auto t){
-		state.for_each_commodity([&](auto cid){
-			if (state.transfer_get_current(t, cid) == 0) return;
-			any_outgoing = true;
-			result += "<li>";
-			result += std::to_string(state.transfer_get_current(t, cid));
-			result += " ";
-			result += get_text(all_text, state.commodity_get_name(cid));
-			auto target = state.transfer_get_target(t);
-			auto attached_to = state.storage_get_attached_to(target);
-			result += " to ";
-			if (attached_to) {
-				result += building_link(attached_to);
-			} else {
-				result += "Personal storage";
-			}
-			result += "</li>";
-		});
+	out.raw("<ul>");
+	view.transfers->for_each_outgoing(storage, [&](transfer_edge const& edge){
+		any_outgoing = true;
+		transfer_row(out, view, edge, edge.target, " to ");
 	});
-	result += "</ul>";
+	out.raw("</ul>");
 	if (!any_outgoing) {
-		result += "None";
-	}
-
-	result += "<h3>Set up outgoing transfer</h3>";
-	result += "<form action=\"" + url_gen::set_transfer() + "\" method=\"post\">";
-	result += "<input name=\"id\" type=\"hidden\" value=\"" + std::to_string(storage.id.index()) + "\">";
-	result += "<p><label for=\"target_storage_select\">Select target storage</label><br>";
-	result += "<select name=\"id2\" id=\"target_storage_select\">";
-	result += "<option value=\"" + std::to_string(state.user_get_storage(owner).id.index()) +  "\">Personal storage</option>";
-	state.user_for_each_ownership(owner, [&](auto o) {
-		auto attached = state.ownership_get_owned(o);
-		auto source = state.building_get_storage(attached);
-		result += "<option value=\"" + std::to_string(source.id.index()) +  "\">" + building_name(attached) + "</option>";
-	});
-	result += "</select></p>";
+		out.raw("None");
+	}
 
-	result += "<select name=\"id3\" id=\"commodity_select\">";
-	state.for_each_commodity([&](auto cid) {
-		result += "<option value=\"" + std::to_string(cid.index()) +  "\">" + get_text(all_text, state.commodity_get_name(cid)) + "</option>";
-	});
-	result += "</select></p>";
+	out.raw("<h3>Set up outgoing transfer</h3>");
+	out.raw("<form action=\"").url(url_path::set_transfer).raw("\" method=\"post\">");
+	out.raw("<input name=\"id\" type=\"hidden\" value=\"").integer(storage.id.index()).raw("\">");
+	out.raw("<p><label for=\"target_storage_select\">Select target storage</label><br>");
+	out.raw("<select name=\"id2\" id=\"target_storage_select\">");
+	storage_options(out, view, owner);
+	out.raw("</select></p>");
+
+	out.raw("<select name=\"id3\" id=\"commodity_select\">");
+	commodity_options(out, view);
+	out.raw("</select></p>");
 
-	result += "<p><label for=\"volume\">Volume</label><br>";
-	result += "<input type=\"number\" id=\"volume\" name=\"volume\" min=\"0\" max=\"3\" /></p>";
+	out.raw("<p><label for=\"volume\">Volume</label><br>");
+	out.raw("<input type=\"number\" id=\"volume\" name=\"volume\" min=\"0\" max=\"3\" /></p>");
 
-	result += "<p><button type=\"submit\">Request transfer change</button></p>";
-	result += "</form>";
+	out.raw("<p><button type=\"submit\">Request transfer change</button></p>");
+	out.raw("</form>");
 
 	auto in_construction = !state.building_get_constructed(bid);
 	if (in_construction) {
-		result += "<h2>Under construction</h2>";
-		result += "<ul>";
+		out.raw("<h2>Under construction</h2>");
+		out.raw("<ul>");
 		auto total = 0;
 		auto total_current = 0;
 		for (int i = 0; i < max_inputs; i++) {
 			auto required_commodity = state.building_type_get_construction(btid, i);
 			if (!required_commodity) break;
 			auto required = state.building_type_get_construction_amount(btid, i);
-			auto current = state.storage_get_current(storage, required_commodity);
+			auto current = view.stockpiles.get(storage, required_commodity);
 			total += required;
 			total_current += current;
-			result += "<li>";
-			result += "<label for=progress-" + std::to_string(i) + ">";
-			result += get_text(all_text, state.commodity_get_name(required_commodity));
-			result += " (" + std::to_string(current) + " out of " + std::to_string(required) + ")";
-			result += "</label><br>";
-			result += "<progress id=\"progress-" + std::to_string(i) +  "\" max=\"" + std::to_string(required) + "\" value=\""+  std::to_string(current) + "\"></progress>";
-			result += "</li>";
-		}
-		result += "</ul>";
-		result += "<label for=progress-total>Total construction progress</label><br>";
-		result += "<progress id=\"progress-total\" max=\"" + std::to_string(total) + "\" value=\""+  std::to_string(total_current) + "\"></progress>";
+			out.raw("<li>");
+			out.raw("<label for=progress-").integer(i).raw(">");
+			out.raw(all_text.escaped(state.commodity_get_name(required_commodity)));
+			out.raw(" (").integer(current).raw(" out of ").integer(required).raw(")");
+			out.raw("</label><br>");
+			out.raw("<progress id=\"progress-").integer(i).raw("\" max=\"").integer(required).raw("\" value=\"").integer(current).raw("\"></progress>");
+			out.raw("</li>");
+		}
+		out.raw("</ul>");
+		out.raw("<label for=progress-total>Total construction progress</label><br>");
+		out.raw("<progress id=\"progress-total\" max=\"").integer(total).raw("\" value=\"").integer(total_current).raw("\"></progress>");
 	} else {
-		result += "<h2>Operation control</h2>";
+		out.raw("<h2>Operation control</h2>");
 
-		result += "<form action=\"" + url_gen::set_building() + "\" method=\"post\">";
-		result += "<input name=\"id\" type=\"hidden\" value=\"" + std::to_string(bid.index()) + "\"><br>";
-		result += "<label for=\"activity_select\">Select activity of the building</label>";
-		result += "<select name=\"id2\" id=\"activity_select\">";
+		out.raw("<form action=\"").url(url_path::set_building).raw("\" method=\"post\">");
+		out.raw("<input name=\"id\" type=\"hidden\" value=\"").integer(bid.index()).raw("\"><br>");
+		out.raw("<label for=\"activity_select\">Select activity of the building</label>");
+		out.raw("<select name=\"id2\" id=\"activity_select\">");
 
 		for (int i = 0; i < max_activities; i++) {
 			auto activity = state.building_type_get_activities(btid, i);
 			if (!activity) break;
-			result += "<option value=\"" + std::to_string(i) + "\">";
-			result += get_text(all_text, state.activity_get_name(activity));
-			result += "</option>";
+			out.raw("<option value=\"").integer(i).raw("\">");
+			out.raw(all_text.escaped(state.activity_get_name(activity)));
+			out.raw("</option>");
 		}
 
-		result += "</select>";
+		out.raw("</select>");
 
-		result += "<p><button type=\"submit\">Set activity</button></p>";
-		result += "</form>";
+		out.raw("<p><button type=\"submit\">Set activity</button></p>");
+		out.raw("</form>");
 	}
 	// result += "<h2>Control<>"
 
-	result += "</body>";
-
-	return result;
+	out.raw("</body>");
 }
 
-std::string make_building_type_report(dcon::building_type_id btid) {
+void make_building_type_report(html_writer& out, dcon::building_type_id btid) {
+	auto current_view = acquire_view();
+	auto const& view = *current_view;
+	auto const& state = view.state;
+
 	if(!state.building_type_is_valid(btid)) {
-		return "<html><head><title>Error</title></head><body>Invalid id</body></html>";
+		out.raw("<html><head><title>Error</title></head><body>Invalid id</body></html>");
+		return;
 	}
-	std::string result =
-		"<html><head><title>"
-		+ get_text(all_text, state.building_type_get_name(btid))
-		+ "</title></head>";
+	auto name = all_text.escaped(state.building_type_get_name(btid));
+	out.raw("<html><head><title>").raw(name).raw("</title></head>");
 
-	result += "<body>" + navigation_header();
+	out.raw("<body>");
+	navigation_header(out);
 
-	result += "<h1>" + get_text(all_text, state.building_type_get_name(btid)) + "</h1>";
+	out.raw("<h1>").raw(name).raw("</h1>");
 
 
-	result += "<h2>Construction</h2>";
+	out.raw("<h2>Construction</h2>");
 	if (state.building_type_get_can_be_constructed(btid)) {
-		result +=
-			"<form action=\"" + url_gen::new_building() + "\" method=\"post\"><input name=\"id\" type=\"hidden\" value=\""
-			+ std::to_string(btid.index())
-			+ "\"><p><button type=\"submit\">Request construction</button></p></form>";
+		out.raw("<form action=\"").url(url_path::new_building).raw("\" method=\"post\"><input name=\"id\" type=\"hidden\" value=\"");
+		out.integer(btid.index());
+		out.raw("\"><p><button type=\"submit\">Request construction</button></p></form>");
 	} else {
-		result +=
-			"This building can't be constructed";
+		out.raw("This building can't be constructed");
 	}
 
-	result += "<h2>Potential activities</h2>";
-	result += "<ul>";
+	out.raw("<h2>Potential activities</h2>");
+	out.raw("<ul>");
 	for (int i = 0; i < max_activities; i++) {
 		auto activity = state.building_type_get_activities(btid, i);
 		if (!activity) break;
-		result += "<li><a href=\"" + url_gen::activity(activity.id.index()) + "\">"
-		+ get_text(all_text, state.activity_get_name(activity))
-		+ "</a></li>";
+		out.raw("<li><a href=\"").url(url_path::activity, activity.id.index()).raw("\">");
+		out.raw(all_text.escaped(state.activity_get_name(activity)));
+		out.raw("</a></li>");
 	}
-	result += "</ul>";
+	out.raw("</ul>");
 
-	result += footer();
-	result +=  "</body></html>";
-	return result;
+	// no generation time: the page is cached for as long as the catalog doesn't change
+	out.raw("</body></html>");
+}
+
+static request_status to_status(bool pushed) {
+	return pushed ? request_status::accepted : request_status::queue_full;
 }
 
+// the ticket travels with the command but stays out of the log
 template<typename T>
-struct safe_ring_queue {
-	std::mutex mtx;
-	std::array<T, 256> items;
-	uint8_t left;
-	uint8_t right;
-
-	bool push(T item) {
-		mtx.lock();
-		if (right + 1 == left) {
-			mtx.unlock();
-			return false;
-		}
-		items[right] = item;
-		right++;
-		mtx.unlock();
-		return true;
-	}
+struct ticketed {
+	T command;
+	command_ticket ticket;
 };
 
 struct construction_request {
 	dcon::user_id user;
 	dcon::building_type_id building_type;
 };
-safe_ring_queue<construction_request> construction_requests_queue {};
-bool request_new_building(dcon::user_id user, dcon::building_type_id building_type) {
-	std::lock_guard<std::mutex> lock {buildings_mutex};
+command_queue<ticketed<construction_request>> construction_requests_queue {default_command_queue_capacity};
+request_status request_new_building(dcon::user_id user, dcon::building_type_id building_type, command_ticket ticket) {
+	std::lock_guard<metered_mutex> lock {buildings_mutex};
 
-	if (!state.building_type_is_valid(building_type)) return false;
-	if (!state.building_type_get_can_be_constructed(building_type)) return false;
+	if (!state.building_type_is_valid(building_type)) return request_status::rejected;
+	if (!state.building_type_get_can_be_constructed(building_type)) return request_status::rejected;
 
 	auto count = 0;
 	state.user_for_each_ownership(user, [&](auto o){count++;});
 
-	if (count > 1000) return false;
-	if (state.building_size() > 10000) return false;
+	if (count > 1000) return request_status::rejected;
+	if (state.building_size() > 10000) return request_status::rejected;
 
-	return construction_requests_queue.push({user, building_type});
+	return to_status(construction_requests_queue.push({{user, building_type}, ticket}));
 }
 
 struct transfer_request {
@@ -633,28 +983,29 @@ struct transfer_request {
 	dcon::commodity_id cid;
 	int volume;
 };
-safe_ring_queue<transfer_request> transfer_requests_queue {};
-bool request_transfer(dcon::user_id user, dcon::storage_id s,  dcon::storage_id t, dcon::commodity_id cid, int volume) {
-	if (volume < 0) return false;
-	if (volume > 5) return false;
+command_queue<ticketed<transfer_request>> transfer_requests_queue {default_command_queue_capacity};
+request_status request_transfer(dcon::user_id user, dcon::storage_id s,  dcon::storage_id t, dcon::commodity_id cid, int volume, command_ticket ticket) {
+	if (volume < 0) return request_status::rejected;
+	if (volume > 5) return request_status::rejected;
 
 	std::lock(transfer_mutex, storage_mutex, user_mutex);
-	std::lock_guard<std::mutex> lock (transfer_mutex, std::adopt_lock);
-	std::lock_guard<std::mutex> lock2 (storage_mutex, std::adopt_lock);
-	std::lock_guard<std::mutex> lock3 (user_mutex, std::adopt_lock);
+	std::lock_guard<metered_mutex> lock (transfer_mutex, std::adopt_lock);
+	std::lock_guard<metered_mutex> lock2 (storage_mutex, std::adopt_lock);
+	std::lock_guard<metered_mutex> lock3 (user_mutex, std::adopt_lock);
 
-	if (!state.storage_is_valid(s)) return false;
-	if (!state.storage_is_valid(t)) return false;
-	if (!state.user_is_valid(user)) return false;
+	if (!state.storage_is_valid(s)) return request_status::rejected;
+	if (!state.storage_is_valid(t)) return request_status::rejected;
+	if (!state.user_is_valid(user)) return request_status::rejected;
+	if (!state.commodity_is_valid(cid)) return request_status::rejected;
 
 	auto so = state.storage_get_owner(s);
 	auto to = state.storage_get_owner(t);
-	if (so != user) return false;
-	if (to != user) return false;
+	if (so != user) return request_status::rejected;
+	if (to != user) return request_status::rejected;
 
-	if (state.transfer_size() > 100000) return false;
+	if (acquire_view()->transfers->edges.size() > 100000) return request_status::rejected;
 
-	return transfer_requests_queue.push({user, s, t, cid, volume});
+	return to_status(transfer_requests_queue.push({{user, s, t, cid, volume}, ticket}));
 }
 
 
@@ -664,22 +1015,22 @@ struct demand_request {
 	__uint128_t price;
 	__uint128_t volume;
 };
-safe_ring_queue<demand_request> demand_requests_queue {};
-bool request_demand(dcon::user_id user, dcon::commodity_id cid, __uint128_t price, __uint128_t volume) {
+command_queue<ticketed<demand_request>> demand_requests_queue {default_command_queue_capacity};
+request_status request_demand(dcon::user_id user, dcon::commodity_id cid, __uint128_t price, __uint128_t volume, command_ticket ticket) {
 	std::lock(user_mutex, demand_mutex);
-	std::lock_guard<std::mutex> lock (user_mutex, std::adopt_lock);
-	std::lock_guard<std::mutex> lock2 (demand_mutex, std::adopt_lock);
+	std::lock_guard<metered_mutex> lock (user_mutex, std::adopt_lock);
+	std::lock_guard<metered_mutex> lock2 (demand_mutex, std::adopt_lock);
 
-	if (!state.user_is_valid(user)) return false;
-	if (!state.commodity_is_valid(cid)) return false;
-	if (price == 0) return false;
-	if (volume == 0) return false;
+	if (!state.user_is_valid(user)) return request_status::rejected;
+	if (!state.commodity_is_valid(cid)) return request_status::rejected;
+	if (price == 0) return request_status::rejected;
+	if (volume == 0) return request_status::rejected;
 	auto required_wealth = price * volume;
-	if (required_wealth / price != volume) return false;
+	if (required_wealth / price != volume) return request_status::rejected;
 	auto savings = state.user_get_wealth(user);
-	if (savings < required_wealth) return false;
+	if (savings < required_wealth) return request_status::rejected;
 
-	return demand_requests_queue.push({user, cid, price, volume});
+	return to_status(demand_requests_queue.push({{user, cid, price, volume}, ticket}));
 }
 
 
@@ -689,21 +1040,22 @@ struct supply_request {
 	__uint128_t price;
 	__uint128_t volume;
 };
-safe_ring_queue<demand_request> supply_requests_queue {};
-bool request_supply(dcon::user_id user, dcon::commodity_id cid, __uint128_t price, __uint128_t volume) {
+command_queue<ticketed<demand_request>> supply_requests_queue {default_command_queue_capacity};
+request_status request_supply(dcon::user_id user, dcon::commodity_id cid, __uint128_t price, __uint128_t volume, command_ticket ticket) {
 	std::lock(user_mutex, supply_mutex);
-	std::lock_guard<std::mutex> lock (user_mutex, std::adopt_lock);
-	std::lock_guard<std::mutex> lock2 (supply_mutex, std::adopt_lock);
-
-	if (!state.user_is_valid(user)) return false;
-	if (!state.commodity_is_valid(cid)) return false;
-	if (price == 0) return false;
-	if (volume == 0) return false;
+	std::lock_guard<metered_mutex> lock (user_mutex, std::adopt_lock);
+	std::lock_guard<metered_mutex> lock2 (supply_mutex, std::adopt_lock);
+
+	if (!state.user_is_valid(user)) return request_status::rejected;
+	if (!state.commodity_is_valid(cid)) return request_status::rejected;
+	if (price == 0) return request_status::rejected;
+	if (volume == 0) return request_status::rejected;
+	// the tick checks the stockpile again, the published one is good enough to turn requests away
 	auto storage = state.user_get_storage(user);
-	auto current = state.storage_get_current(storage, cid);
-	if (current < volume) return false;
+	auto current = acquire_view()->stockpiles.get(storage, cid);
+	if (current < volume) return request_status::rejected;
 
-	return supply_requests_queue.push({user, cid, price, volume});
+	return to_status(supply_requests_queue.push({{user, cid, price, volume}, ticket}));
 }
 
 struct building_settings_request {
@@ -711,62 +1063,670 @@ struct building_settings_request {
 	dcon::building_id bid;
 	dcon::activity_id aid;
 };
-safe_ring_queue<building_settings_request> building_settings_queue {};
-bool request_settings_change(dcon::user_id user, dcon::building_id building, int i) {
-	std::lock_guard<std::mutex> lock {buildings_mutex};
-
-	if (i < 0) return false;
-	if (i >= max_activities) return false;
-	if (!state.building_is_valid(building)) return false;
-	if (!state.user_is_valid(user)) return false;
+command_queue<ticketed<building_settings_request>> building_settings_queue {default_command_queue_capacity};
+request_status request_settings_change(dcon::user_id user, dcon::building_id building, int i, command_ticket ticket) {
+	std::lock_guard<metered_mutex> lock {buildings_mutex};
+
+	if (i < 0) return request_status::rejected;
+	if (i >= max_activities) return request_status::rejected;
+	if (!state.building_is_valid(building)) return request_status::rejected;
+	if (!state.user_is_valid(user)) return request_status::rejected;
 	auto ownership = state.get_ownership_by_ownership_pair(building, user);
-	if (!ownership) return false;
+	if (!ownership) return request_status::rejected;
 	auto btid = state.building_get_building_type(building);
 	auto activity = state.building_type_get_activities(btid, i);
-	if (!activity) return false;
-	return building_settings_queue.push({user, building, activity});
+	if (!activity) return request_status::rejected;
+	return to_status(building_settings_queue.push({{user, building, activity}, ticket}));
 }
 
 struct gacha_request {
 	dcon::user_id user;
 	int count;
 };
-safe_ring_queue<gacha_request> gacha_queue {};
-bool request_gacha(dcon::user_id user, int count) {
+command_queue<ticketed<gacha_request>> gacha_queue {default_command_queue_capacity};
+request_status request_gacha(dcon::user_id user, int count, command_ticket ticket) {
 	{
-		std::lock_guard<std::mutex> lock {gacha_tickets_mutex};
-		if(!state.user_is_valid(user)) return false;
-		if (count < 0) return false;
-		if (pulls_count(user) < count) return false;
+		std::lock_guard<metered_mutex> lock {gacha_tickets_mutex};
+		if(!state.user_is_valid(user)) return request_status::rejected;
+		if (count < 0) return request_status::rejected;
+		if (pulls_count(user) < count) return request_status::rejected;
 	}
 
-	return gacha_queue.push({user, count});
+	return to_status(gacha_queue.push({{user, count}, ticket}));
+}
+
+/*
+
+Production
+
+Constructed buildings are grouped by their activity,
+so the recipe is read once per group and storages are processed in parallel.
+With dense stockpiles a group is processed in vectors of storages:
+inputs are gathered from their columns and a lane produces only when every input is in stock.
+
+*/
+
+static std::vector<std::vector<dcon::storage_id>> production_groups;
+static bool production_groups_dirty = true;
+
+void rebuild_production_groups() {
+	for (auto& group : production_groups) {
+		group.clear();
+	}
+	production_groups.resize(state.activity_size());
+	state.for_each_building([&](dcon::building_id building){
+		if (!state.building_get_constructed(building)) return;
+		auto activity = state.building_get_activity(building);
+		if (!activity) return;
+		production_groups[activity.index()].push_back(state.building_get_storage(building));
+	});
+	production_groups_dirty = false;
 }
 
-std::random_device global_device;
-std::seed_seq global_seed{
-	global_device(),
-	global_device(),
-	global_device(),
-	global_device(),
-	global_device(),
-	global_device(),
-	global_device(),
-	global_device()
+struct production_recipe {
+	dcon::commodity_id inputs[max_inputs];
+	int32_t input_amounts[max_inputs];
+	int inputs_count = 0;
+	dcon::commodity_id outputs[max_outputs];
+	int32_t output_amounts[max_outputs];
+	int outputs_count = 0;
 };
-std::mt19937 global_engine(global_seed);
 
-void simulation_update() {
-	gacha_queue.mtx.lock();
-	for (uint8_t i = gacha_queue.left; i != gacha_queue.right; i++) {
-		std::lock(gacha_tickets_mutex, storage_mutex, user_mutex);
-		std::lock_guard<std::mutex> lock (storage_mutex, std::adopt_lock);
-		std::lock_guard<std::mutex> lock2 (gacha_tickets_mutex, std::adopt_lock);
-		std::lock_guard<std::mutex> lock3 (user_mutex, std::adopt_lock);
+static void run_production_sparse(production_recipe const& recipe, std::vector<dcon::storage_id> const& storages) {
+	tbb::parallel_for(tbb::blocked_range<size_t>(0, storages.size()), [&](auto const& range){
+		for (auto index = range.begin(); index != range.end(); index++) {
+			auto storage = storages[index];
 
-		auto& item = gacha_queue.items[i];
+			bool ready = true;
+			for (int i = 0; i < recipe.inputs_count; i++) {
+				ready = ready && stockpiles.get(storage, recipe.inputs[i]) >= recipe.input_amounts[i];
+			}
+			if (!ready) continue;
+
+			for (int i = 0; i < recipe.inputs_count; i++) {
+				stockpiles.add(storage, recipe.inputs[i], -recipe.input_amounts[i]);
+			}
+			for (int i = 0; i < recipe.outputs_count; i++) {
+				stockpiles.add(storage, recipe.outputs[i], recipe.output_amounts[i]);
+			}
+		}
+	});
+}
+
+#if defined(__AVX2__)
+static constexpr uint32_t production_lanes = 8;
+
+static void run_production_dense(production_recipe const& recipe, std::vector<dcon::storage_id> const& storages) {
+	size_t chunks = (storages.size() + production_lanes - 1) / production_lanes;
+	tbb::parallel_for(tbb::blocked_range<size_t>(0, chunks), [&](auto const& range){
+		for (auto chunk = range.begin(); chunk != range.end(); chunk++) {
+			auto offset = chunk * production_lanes;
+			auto lanes = (uint32_t)std::min<size_t>(production_lanes, storages.size() - offset);
+
+			alignas(32) int32_t index[production_lanes] = {};
+			alignas(32) int32_t mask[production_lanes] = {};
+			for (uint32_t i = 0; i < lanes; i++) {
+				index[i] = (int32_t)storages[offset + i].index();
+				mask[i] = -1;
+			}
+			auto storage = _mm256_load_si256((__m256i const*)index);
+
+			// every bit is set in lanes which have every input in stock
+			auto ready = _mm256_load_si256((__m256i const*)mask);
+			for (int i = 0; i < recipe.inputs_count; i++) {
+				auto stockpile = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), stockpiles.column(recipe.inputs[i]), storage, ready, 4);
+				auto missing = _mm256_cmpgt_epi32(_mm256_set1_epi32(recipe.input_amounts[i]), stockpile);
+				ready = _mm256_andnot_si256(missing, ready);
+			}
+			if (_mm256_testz_si256(ready, ready)) continue;
+			_mm256_store_si256((__m256i*)mask, ready);
+
+			auto apply = [&](dcon::commodity_id cid, int32_t amount) {
+				auto column = stockpiles.column(cid);
+				auto stockpile = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), column, storage, ready, 4);
+				alignas(32) int32_t result[production_lanes];
+				_mm256_store_si256((__m256i*)result, _mm256_add_epi32(stockpile, _mm256_set1_epi32(amount)));
+				// there is no scatter before AVX-512
+				for (uint32_t i = 0; i < lanes; i++) {
+					if (mask[i]) column[index[i]] = result[i];
+				}
+			};
+			for (int i = 0; i < recipe.inputs_count; i++) {
+				apply(recipe.inputs[i], -recipe.input_amounts[i]);
+			}
+			for (int i = 0; i < recipe.outputs_count; i++) {
+				apply(recipe.outputs[i], recipe.output_amounts[i]);
+			}
+		}
+	});
+}
+#endif
+
+// Storages of a group are unique, so chunks could be processed independently.
+void run_production(dcon::activity_id activity, std::vector<dcon::storage_id> const& storages) {
+	production_recipe recipe;
+	for (; recipe.inputs_count < max_inputs; recipe.inputs_count++) {
+		auto input = state.activity_get_input(activity, recipe.inputs_count);
+		if (!input) break;
+		recipe.inputs[recipe.inputs_count] = input;
+		recipe.input_amounts[recipe.inputs_count] = state.activity_get_input_amount(activity, recipe.inputs_count);
+	}
+	for (; recipe.outputs_count < max_outputs; recipe.outputs_count++) {
+		auto output = state.activity_get_output(activity, recipe.outputs_count);
+		if (!output) break;
+		recipe.outputs[recipe.outputs_count] = output;
+		recipe.output_amounts[recipe.outputs_count] = state.activity_get_output_amount(activity, recipe.outputs_count);
+	}
+
+#if defined(__AVX2__)
+	if (stockpiles.get_layout() == inventory_layout::dense) {
+		run_production_dense(recipe, storages);
+		return;
+	}
+#endif
+	run_production_sparse(recipe, storages);
+}
+
+/*
+
+Transfers
+
+Flows are computed from stockpiles at the start of the phase and applied afterwards,
+so results don't depend on the order of transfers or on the number of threads.
+A source which can't satisfy all outgoing transfers splits its stockpile proportionally.
+Commodities are independent of each other, so every commodity is a task of its own.
+
+*/
+
+struct stockpile_delta {
+	dcon::storage_id storage;
+	dcon::commodity_id cid;
+	int64_t amount;
+};
+
+// requested during the tick, applied to the table at the end of the transfer requests phase
+static std::vector<transfer_edge> transfer_changes;
+// per commodity, in edge order
+static std::vector<std::vector<stockpile_delta>> transfer_deltas;
+
+// edges leaving one stockpile are neighbours in the table, so groups are read in one pass
+static void collect_flows(transfer_table const& table, uint32_t raw_cid, std::vector<stockpile_delta>& deltas) {
+	auto const& edges = table.edges;
+	auto end = table.commodity_offsets[raw_cid + 1];
+	deltas.clear();
+	for (auto first = table.commodity_offsets[raw_cid]; first < end;) {
+		auto source = edges[first].source;
+		auto cid = edges[first].cid;
+		auto last = first;
+		int64_t outgoing = 0;
+		while (last < end && edges[last].source == source) {
+			outgoing += edges[last].volume;
+			last++;
+		}
+		int64_t available = stockpiles.get(source, cid);
+		for (auto i = first; i < last; i++) {
+			int64_t movement = edges[i].volume;
+			auto flow = outgoing <= available ? movement : movement * std::max<int64_t>(available, 0) / outgoing;
+			if (flow == 0) continue;
+			deltas.push_back({source, cid, -flow});
+			deltas.push_back({edges[i].target, cid, flow});
+		}
+		first = last;
+	}
+}
+
+static void apply_flows(std::vector<stockpile_delta> const& deltas) {
+	for (auto& delta : deltas) {
+		stockpiles.add(delta.storage, delta.cid, (int32_t)delta.amount);
+	}
+}
+
+void update_transfers() {
+	auto table = transfers;
+	uint32_t commodities = table->commodity_offsets.empty() ? 0 : (uint32_t)table->commodity_offsets.size() - 1;
+	transfer_deltas.resize(std::max<size_t>(transfer_deltas.size(), commodities));
+	// storages are changed in parallel below, none of them may grow the table
+	stockpiles.resize(state.storage_size(), state.commodity_size());
+
+	// a dense column belongs to one commodity, so its task applies the flows as well;
+	// sparse storages share one map between commodities and are changed after every task is done
+	bool apply_in_task = stockpiles.get_layout() == inventory_layout::dense;
+	tbb::parallel_for((uint32_t)0, commodities, [&](uint32_t raw_cid){
+		collect_flows(*table, raw_cid, transfer_deltas[raw_cid]);
+		if (apply_in_task) {
+			apply_flows(transfer_deltas[raw_cid]);
+		}
+	});
+	if (!apply_in_task) {
+		for (uint32_t raw_cid = 0; raw_cid < commodities; raw_cid++) {
+			apply_flows(transfer_deltas[raw_cid]);
+		}
+	}
+}
+
+void configure_stockpiles(inventory_layout layout) {
+	stockpiles.set_layout(layout);
+}
+
+void configure_command_queues(int64_t requested) {
+	size_t capacity = default_command_queue_capacity;
+	constexpr size_t max_capacity = decltype(gacha_queue)::max_capacity;
+	if (requested < 1) {
+		printf("Command queue capacity %lld is invalid, using %zu\n", (long long)requested, capacity);
+	} else if ((uint64_t)requested > max_capacity) {
+		capacity = max_capacity;
+		printf("Command queue capacity %lld is too large, using %zu\n", (long long)requested, capacity);
+	} else {
+		capacity = (size_t)requested;
+	}
+	gacha_queue.reserve(capacity);
+	construction_requests_queue.reserve(capacity);
+	building_settings_queue.reserve(capacity);
+	transfer_requests_queue.reserve(capacity);
+	demand_requests_queue.reserve(capacity);
+	supply_requests_queue.reserve(capacity);
+}
+
+struct queue_sample {
+	const char* name;
+	size_t depth;
+	size_t capacity;
+	uint64_t accepted;
+	uint64_t dropped;
+};
+
+template<typename T>
+static queue_sample sample_queue(const char* name, command_queue<T> const& queue) {
+	return {
+		name,
+		queue.depth(),
+		queue.capacity(),
+		queue.accepted.load(std::memory_order_relaxed),
+		queue.dropped.load(std::memory_order_relaxed)
+	};
+}
+
+void write_simulation_metrics(std::string& result) {
+	// queues are sampled once, so every family is one block and they agree with each other
+	queue_sample queues[] = {
+		sample_queue("gacha", gacha_queue),
+		sample_queue("construction", construction_requests_queue),
+		sample_queue("settings", building_settings_queue),
+		sample_queue("transfer", transfer_requests_queue),
+		sample_queue("demand", demand_requests_queue),
+		sample_queue("supply", supply_requests_queue)
+	};
+	result += "# TYPE command_queue_depth gauge\n";
+	for (auto& queue : queues) {
+		result += std::format("command_queue_depth{{queue=\"{}\"}} {}\n", queue.name, queue.depth);
+	}
+	result += "# TYPE command_queue_capacity gauge\n";
+	for (auto& queue : queues) {
+		result += std::format("command_queue_capacity{{queue=\"{}\"}} {}\n", queue.name, queue.capacity);
+	}
+	result += "# TYPE command_queue_accepted_total counter\n";
+	for (auto& queue : queues) {
+		result += std::format("command_queue_accepted_total{{queue=\"{}\"}} {}\n", queue.name, queue.accepted);
+	}
+	result += "# TYPE command_queue_dropped_total counter\n";
+	for (auto& queue : queues) {
+		result += std::format("command_queue_dropped_total{{queue=\"{}\"}} {}\n", queue.name, queue.dropped);
+	}
+
+	auto view = acquire_view();
+	if (!view) return;
+	auto const& state = view->state;
+	result += "# TYPE world_tick gauge\n";
+	result += std::format("world_tick {}\n", view->tick);
+	result += "# TYPE world_entities gauge\n";
+	result += std::format("world_entities{{kind=\"user\"}} {}\n", state.user_size());
+	result += std::format("world_entities{{kind=\"building\"}} {}\n", state.building_size());
+	result += std::format("world_entities{{kind=\"storage\"}} {}\n", state.storage_size());
+	result += std::format("world_entities{{kind=\"transfer\"}} {}\n", view->transfers->edges.size());
+	result += std::format("world_entities{{kind=\"ownership\"}} {}\n", state.ownership_size());
+	result += std::format("world_entities{{kind=\"demand\"}} {}\n", state.demand_size());
+	result += std::format("world_entities{{kind=\"supply\"}} {}\n", state.supply_size());
+	result += std::format("world_entities{{kind=\"commodity\"}} {}\n", state.commodity_size());
+	result += "# TYPE stockpile_memory_bytes gauge\n";
+	result += std::format("stockpile_memory_bytes {}\n", view->stockpiles.memory_bytes());
+	result += "# TYPE stockpile_dense_storages gauge\n";
+	result += std::format("stockpile_dense_storages {}\n", view->stockpiles.dense_storages());
+	result += "# TYPE transfer_memory_bytes gauge\n";
+	result += std::format("transfer_memory_bytes {}\n", view->transfers->memory_bytes());
+}
+
+void set_world_seed(uint64_t seed) {
+	std::lock_guard<metered_mutex> lock {tick_mutex};
+	world_seed = seed;
+}
+
+uint64_t world_checksum() {
+	std::lock_guard<metered_mutex> lock {tick_mutex};
+	// FNV-1a over every non-zero stockpile and every balance
+	uint64_t hash = 14695981039346656037ull;
+	auto mix = [&](uint64_t value) {
+		for (int i = 0; i < 8; i++) {
+			hash = (hash ^ ((value >> (i * 8)) & 0xff)) * 1099511628211ull;
+		}
+	};
+	for (uint32_t raw = 0; raw < stockpiles.size(); raw++) {
+		stockpiles.for_each(dcon::storage_id {(dcon::storage_id::value_base_t)raw}, [&](auto cid, int32_t amount) {
+			mix(raw);
+			mix(cid.index());
+			mix((uint32_t)amount);
+		});
+	}
+	state.for_each_user([&](auto user) {
+		auto wealth = state.user_get_wealth(user);
+		mix(user.index());
+		mix((uint64_t)wealth);
+		mix((uint64_t)(wealth >> 64));
+	});
+	return hash;
+}
+
+/*
+
+Persistence
+
+The world is saved as a binary snapshot, commands applied after it are kept in the log.
+Recovery maps the snapshot and replays ticks recorded after it.
+Properties tagged legacy in data.txt, and the transfer relationship which holds one of them,
+are read only to migrate snapshots of versions 1 to 3 and are emptied right after.
+
+*/
+
+struct snapshot_header {
+	char magic[8];
+	uint64_t version;
+	uint64_t tick;
+	uint64_t text_size;
+	uint64_t words;
+	uint64_t container_size;
+	// added in version 2
+	uint64_t world_seed;
+	// added in version 3, older versions kept stockpiles in the container
+	uint64_t stockpile_entries;
+	// added in version 4, older versions kept transfers in the container
+	uint64_t transfer_entries;
+	// added in version 5, older versions didn't save the order of arrival of orders
+	uint64_t order_sequence;
+};
+
+struct stockpile_entry {
+	uint32_t storage;
+	uint32_t commodity;
+	int32_t amount;
+};
+
+struct transfer_entry {
+	uint32_t source;
+	uint32_t target;
+	uint32_t commodity;
+	int32_t volume;
+};
+
+static constexpr char snapshot_magic[8] = {'0', '1', '1', 'W', 'O', 'R', 'L', 'D'};
+static constexpr uint64_t snapshot_version = 5;
+static constexpr size_t snapshot_header_sizes[] = {
+	0,
+	offsetof(snapshot_header, world_seed),
+	offsetof(snapshot_header, stockpile_entries),
+	offsetof(snapshot_header, transfer_entries),
+	offsetof(snapshot_header, order_sequence),
+	sizeof(snapshot_header)
+};
+
+static std::string snapshot_file;
+static uint64_t snapshot_interval = 0;
+
+static bool save_snapshot(const char* path) {
+	auto record = state.serialize_entire_container_record();
+
+	snapshot_header header {};
+	memcpy(header.magic, snapshot_magic, sizeof(snapshot_magic));
+	header.version = snapshot_version;
+	header.tick = current_tick;
+	header.world_seed = world_seed;
+	header.order_sequence = order_sequence;
+	// text keeps the layout of a flat buffer of null terminated strings
+	header.words = all_text.size();
+	std::vector<uint32_t> word_start(header.words);
+	std::vector<uint32_t> word_length(header.words);
+	uint64_t text_size = 0;
+	for (uint32_t key = 0; key < header.words; key++) {
+		word_start[key] = (uint32_t)text_size;
+		word_length[key] = (uint32_t)all_text.get(key).size();
+		text_size += word_length[key] + 1;
+	}
+	header.text_size = text_size;
+	header.container_size = state.serialize_size(record);
+
+	std::vector<stockpile_entry> stockpile_entries;
+	for (uint32_t raw = 0; raw < stockpiles.size(); raw++) {
+		stockpiles.for_each(dcon::storage_id {(dcon::storage_id::value_base_t)raw}, [&](auto cid, int32_t amount) {
+			stockpile_entries.push_back({raw, (uint32_t)cid.index(), amount});
+		});
+	}
+	header.stockpile_entries = stockpile_entries.size();
+
+	std::vector<transfer_entry> transfer_entries;
+	for (auto& edge : transfers->edges) {
+		transfer_entries.push_back({
+			(uint32_t)edge.source.index(),
+			(uint32_t)edge.target.index(),
+			(uint32_t)edge.cid.index(),
+			edge.volume
+		});
+	}
+	header.transfer_entries = transfer_entries.size();
+
+	std::vector<std::byte> container(header.container_size);
+	auto output = container.data();
+	state.serialize(output, record);
+
+	auto temporary = std::string(path) + ".tmp";
+	FILE* file = fopen(temporary.c_str(), "wb");
+	if (!file) return false;
+	bool written = fwrite(&header, sizeof(header), 1, file) == 1;
+	for (uint32_t key = 0; written && key < header.words; key++) {
+		auto word = all_text.get(key);
+		written = fwrite(word.data(), 1, word.size() + 1, file) == word.size() + 1;
+	}
+	written = written
+		&& fwrite(word_start.data(), sizeof(uint32_t), header.words, file) == header.words
+		&& fwrite(word_length.data(), sizeof(uint32_t), header.words, file) == header.words
+		&& fwrite(container.data(), 1, header.container_size, file) == header.container_size
+		&& fwrite(stockpile_entries.data(), sizeof(stockpile_entry), stockpile_entries.size(), file) == stockpile_entries.size()
+		&& fwrite(transfer_entries.data(), sizeof(transfer_entry), transfer_entries.size(), file) == transfer_entries.size()
+		&& fflush(file) == 0
+		&& fsync(fileno(file)) == 0;
+	fclose(file);
+	if (!written) {
+		remove(temporary.c_str());
+		return false;
+	}
+	return rename(temporary.c_str(), path) == 0;
+}
+
+// indices which are not stored in the container
+static void rebuild_derived_data() {
+	{
+		std::unique_lock<std::shared_mutex> lock {names_mutex};
+		name_to_user.clear();
+		state.for_each_user([&](auto user){
+			name_to_user[std::string(all_text.get(state.user_get_name(user)))] = user;
+		});
+	}
+
+	order_books.clear();
+	order_books.resize(state.commodity_size());
+	state.for_each_demand([&](auto demand){
+		restore_to_order_book(demand);
+	});
+	state.for_each_supply([&](auto supply){
+		restore_to_order_book(supply);
+	});
+
+	production_groups_dirty = true;
+	gacha_sampler_dirty = true;
+	mark_catalog_changed();
+}
+
+// none when there is no snapshot at all, failed when it exists but can't be loaded
+static recovery_result load_snapshot(const char* path) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return errno == ENOENT ? recovery_result::none : recovery_result::failed;
+	struct stat info;
+	if (fstat(fd, &info) != 0 || (size_t)info.st_size < snapshot_header_sizes[1]) {
+		close(fd);
+		return recovery_result::failed;
+	}
+	size_t size = info.st_size;
+	auto mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapped == MAP_FAILED) return recovery_result::failed;
+
+	auto bytes = (std::byte const*) mapped;
+	snapshot_header header {};
+	memcpy(&header, bytes, snapshot_header_sizes[1]);
+	bool known_version = header.version >= 1 && header.version <= snapshot_version;
+	// fields added by later versions stay zero
+	auto header_size = known_version ? snapshot_header_sizes[header.version] : sizeof(header);
+	if (known_version && size >= header_size) {
+		memcpy(&header, bytes, header_size);
+	}
+	auto expected_size =
+		header_size
+		+ header.text_size
+		+ header.words * sizeof(uint32_t) * 2
+		+ header.container_size
+		+ header.stockpile_entries * sizeof(stockpile_entry)
+		+ header.transfer_entries * sizeof(transfer_entry);
+	if (
+		memcmp(header.magic, snapshot_magic, sizeof(snapshot_magic)) != 0
+		|| !known_version
+		|| expected_size != size
+	) {
+		printf("%s is not a compatible snapshot\n", path);
+		munmap(mapped, size);
+		return recovery_result::failed;
+	}
+
+	auto input = bytes + header_size;
+	auto text = (char const*) input;
+	input += header.text_size;
+	std::vector<uint32_t> word_start(header.words);
+	memcpy(word_start.data(), input, header.words * sizeof(uint32_t));
+	input += header.words * sizeof(uint32_t);
+	std::vector<uint32_t> word_length(header.words);
+	memcpy(word_length.data(), input, header.words * sizeof(uint32_t));
+	input += header.words * sizeof(uint32_t);
+	// keys are stored in the container, so they are restored one to one even for duplicates
+	all_text.clear();
+	for (uint64_t key = 0; key < header.words; key++) {
+		if (all_text.append({text + word_start[key], word_length[key]}) == text_store::no_key) {
+			printf("%s has more text than fits into the text store\n", path);
+			all_text.clear();
+			munmap(mapped, size);
+			return recovery_result::failed;
+		}
+	}
+
+	dcon::load_record loaded;
+	state.deserialize(input, input + header.container_size, loaded);
+	input += header.container_size;
+
+	stockpiles.clear();
+	stockpiles.resize(state.storage_size(), state.commodity_size());
+	if (header.version < 3) {
+		// older versions kept a column per commodity in the container, it is moved out and dropped
+		state.for_each_storage([&](auto storage){
+			state.for_each_commodity([&](auto cid){
+				stockpiles.set(storage, cid, state.storage_get_current(storage, cid));
+			});
+		});
+		state.storage_resize_current(0);
+	} else {
+		for (uint64_t i = 0; i < header.stockpile_entries; i++) {
+			stockpile_entry entry;
+			memcpy(&entry, input + i * sizeof(stockpile_entry), sizeof(stockpile_entry));
+			stockpiles.set(
+				dcon::storage_id {(dcon::storage_id::value_base_t)entry.storage},
+				dcon::commodity_id {(dcon::commodity_id::value_base_t)entry.commodity},
+				entry.amount
+			);
+		}
+		input += header.stockpile_entries * sizeof(stockpile_entry);
+	}
+
+	std::vector<transfer_edge> edges;
+	if (header.version < 4) {
+		// older versions kept a transfer per pair of storages with a column per commodity
+		std::vector<dcon::transfer_id> legacy;
+		state.for_each_transfer([&](auto t){
+			legacy.push_back(t);
+			state.for_each_commodity([&](auto cid){
+				auto volume = state.transfer_get_current(t, cid);
+				if (volume == 0) return;
+				edges.push_back({state.transfer_get_source(t), state.transfer_get_target(t), cid, volume});
+			});
+		});
+		for (auto t : legacy) {
+			state.delete_transfer(t);
+		}
+		state.transfer_resize_current(0);
+	} else {
+		for (uint64_t i = 0; i < header.transfer_entries; i++) {
+			transfer_entry entry;
+			memcpy(&entry, input + i * sizeof(transfer_entry), sizeof(transfer_entry));
+			edges.push_back({
+				dcon::storage_id {(dcon::storage_id::value_base_t)entry.source},
+				dcon::storage_id {(dcon::storage_id::value_base_t)entry.target},
+				dcon::commodity_id {(dcon::commodity_id::value_base_t)entry.commodity},
+				entry.volume
+			});
+		}
+	}
+	transfers = change_transfers(transfer_table {}, edges, state.storage_size(), state.commodity_size());
+	munmap(mapped, size);
+
+	if (header.version < 5) {
+		// the order of arrival was lost, slots are the best guess left
+		order_sequence = 0;
+		state.for_each_demand([&](auto demand){
+			state.demand_set_sequence(demand, order_sequence++);
+		});
+		state.for_each_supply([&](auto supply){
+			state.supply_set_sequence(supply, order_sequence++);
+		});
+	} else {
+		order_sequence = header.order_sequence;
+	}
+
+	current_tick = header.tick;
+	// version 1 had no world seed, its worlds continue with a new one
+	world_seed = header.version == 1 ? fresh_world_seed() : header.world_seed;
+	rebuild_derived_data();
+	return recovery_result::loaded;
+}
+
+static void run_tick() {
+	log_command(log_record_type::tick, world_seed);
+
+	phase_timer timer {tick_phase::gacha};
+	// requests have no id of their own, their position in the tick tells their streams apart
+	uint32_t gacha_position = 0;
+	for (ticketed<gacha_request> queued; gacha_queue.pop(queued); gacha_position++) {
+		auto& item = queued.command;
+		log_command(log_record_type::gacha, item);
+		std::lock(gacha_tickets_mutex, storage_mutex, user_mutex);
+		std::lock_guard<metered_mutex> lock (storage_mutex, std::adopt_lock);
+		std::lock_guard<metered_mutex> lock2 (gacha_tickets_mutex, std::adopt_lock);
+		std::lock_guard<metered_mutex> lock3 (user_mutex, std::adopt_lock);
 
 		if (state.user_get_development_tickets(item.user) < item.count) {
+			resolve_ticket(queued.ticket, command_outcome::rejected);
 			continue;
 		}
 
@@ -775,23 +1735,9 @@ void simulation_update() {
 			state.user_get_development_tickets(item.user) - item.count
 		);
 
+		random_stream rng {world_seed, current_tick, gacha_position, rng_stream::gacha};
 		for (int q = 0; q < item.count; q++) {
-			float total_score = 0.f;
-			state.for_each_building_type([&](auto cid){
-				total_score += state.building_type_get_gacha_weight(cid);
-			});
-			std::uniform_real_distribution<float> dist(
-				0, total_score
-			);
-			float current_score = dist(global_engine);
-			float counter = 0.f;
-			dcon::building_type_id result {};
-			state.for_each_building_type([&](auto cid){
-				counter += state.building_type_get_gacha_weight(cid);
-				if (counter > current_score &&  !result) {
-					result = cid;
-				}
-			});
+			auto result = draw_building_type(rng);
 			// auto storage = state.user_get_storage(item.user);
 			// state.storage_set_current(storage, result, state.storage_get_current(storage, result) + 100);
 
@@ -803,20 +1749,22 @@ void simulation_update() {
 			state.building_set_building_type(bid, result);
 			state.force_create_ownership(bid, item.user);
 			state.building_set_constructed(bid, true);
+			mark_ownership_changed(item.user);
 		}
+		resolve_ticket(queued.ticket, command_outcome::applied);
 	}
-	gacha_queue.left = gacha_queue.right;
-	gacha_queue.mtx.unlock();
 
-	construction_requests_queue.mtx.lock();
-	for (uint8_t i = construction_requests_queue.left; i != construction_requests_queue.right; i++) {
+	timer.next(tick_phase::construction);
+	for (ticketed<construction_request> queued; construction_requests_queue.pop(queued);) {
+		auto& item = queued.command;
+		log_command(log_record_type::construction, item);
 		std::lock(buildings_mutex, storage_mutex);
-		std::lock_guard<std::mutex> lock (buildings_mutex, std::adopt_lock);
-		std::lock_guard<std::mutex> lock2 (storage_mutex, std::adopt_lock);
+		std::lock_guard<metered_mutex> lock (buildings_mutex, std::adopt_lock);
+		std::lock_guard<metered_mutex> lock2 (storage_mutex, std::adopt_lock);
 
-		auto& item = construction_requests_queue.items[i];
 		auto w  = state.user_get_wealth(item.user);
 		if (w < building_permission_cost) {
+			resolve_ticket(queued.ticket, command_outcome::rejected);
 			continue;
 		}
 
@@ -828,117 +1776,138 @@ void simulation_update() {
 		state.building_set_building_type(bid, item.building_type);
 		state.force_create_ownership(bid, item.user);
 		state.building_set_constructed(bid, false);
+		mark_ownership_changed(item.user);
 		savings_mutex.lock();
 		state.user_set_wealth(item.user, w  - building_permission_cost);
 		savings_mutex.unlock();
+		resolve_ticket(queued.ticket, command_outcome::applied);
 	}
-	construction_requests_queue.left = construction_requests_queue.right;
-	construction_requests_queue.mtx.unlock();
 
-	building_settings_queue.mtx.lock();
-	for (uint8_t i = building_settings_queue.left; i != building_settings_queue.right; i++) {
-		std::lock_guard<std::mutex> lock {buildings_mutex};
-		auto& item = building_settings_queue.items[i];
+	timer.next(tick_phase::settings);
+	for (ticketed<building_settings_request> queued; building_settings_queue.pop(queued);) {
+		auto& item = queued.command;
+		log_command(log_record_type::settings, item);
+		std::lock_guard<metered_mutex> lock {buildings_mutex};
 		state.building_set_activity(item.bid, item.aid);
+		production_groups_dirty = true;
+		mark_ownership_changed(state.building_get_owner_from_ownership(item.bid));
+		resolve_ticket(queued.ticket, command_outcome::applied);
 	}
-	building_settings_queue.left = building_settings_queue.right;
-	building_settings_queue.mtx.unlock();
 
 
-	transfer_requests_queue.mtx.lock();
-	for (uint8_t i = transfer_requests_queue.left; i != transfer_requests_queue.right; i++) {
-		std::lock_guard<std::mutex> lock {transfer_mutex};
-		auto& item = transfer_requests_queue.items[i];
-		auto existing = state.get_transfer_by_transfer_pair(item.source, item.target);
-		if(!existing) existing = state.force_create_transfer(item.source, item.target);
-		state.transfer_set_current(existing, item.cid, item.volume);
+	timer.next(tick_phase::transfer_requests);
+	for (ticketed<transfer_request> queued; transfer_requests_queue.pop(queued);) {
+		auto& item = queued.command;
+		log_command(log_record_type::transfer, item);
+		transfer_changes.push_back({item.source, item.target, item.cid, item.volume});
+		resolve_ticket(queued.ticket, command_outcome::applied);
+	}
+	if (!transfer_changes.empty()) {
+		std::lock_guard<metered_mutex> lock {transfer_mutex};
+		transfers = change_transfers(*transfers, transfer_changes, state.storage_size(), state.commodity_size());
+		transfer_changes.clear();
 	}
-	transfer_requests_queue.left = transfer_requests_queue.right;
-	transfer_requests_queue.mtx.unlock();
 
-	demand_requests_queue.mtx.lock();
-	for (uint8_t i = demand_requests_queue.left; i != demand_requests_queue.right; i++) {
-		std::lock_guard<std::mutex> lock {demand_mutex};
-		std::lock_guard<std::mutex> lock2 {user_mutex};
-		auto& item = demand_requests_queue.items[i];
+	timer.next(tick_phase::demand);
+	for (ticketed<demand_request> queued; demand_requests_queue.pop(queued);) {
+		auto& item = queued.command;
+		log_command(log_record_type::demand, item);
+		std::lock_guard<metered_mutex> lock {demand_mutex};
+		std::lock_guard<metered_mutex> lock2 {user_mutex};
 		auto wealth = state.user_get_wealth(item.user);
 		auto required = item.volume * item.price;
-		if (required > wealth) continue;
+		if (required > wealth) {
+			resolve_ticket(queued.ticket, command_outcome::rejected);
+			continue;
+		}
 		state.user_set_wealth(item.user, wealth - required);
 		auto demand = state.create_demand();
 		state.demand_set_volume(demand, item.volume);
 		state.demand_set_price(demand, item.price);
 		state.demand_set_cid(demand, item.cid);
 		state.force_create_demand_ownership(demand, item.user);
+		add_to_order_book(demand);
+		resolve_ticket(queued.ticket, command_outcome::applied);
 	}
-	demand_requests_queue.left = demand_requests_queue.right;
-	demand_requests_queue.mtx.unlock();
 
-	supply_requests_queue.mtx.lock();
-	for (uint8_t i = supply_requests_queue.left; i != supply_requests_queue.right; i++) {
-		std::lock_guard<std::mutex> lock {supply_mutex};
-		std::lock_guard<std::mutex> lock2 {user_mutex};
-		std::lock_guard<std::mutex> lock3 {storage_mutex};
-		auto& item = supply_requests_queue.items[i];
+	timer.next(tick_phase::supply);
+	for (ticketed<demand_request> queued; supply_requests_queue.pop(queued);) {
+		auto& item = queued.command;
+		log_command(log_record_type::supply, item);
+		std::lock_guard<metered_mutex> lock {supply_mutex};
+		std::lock_guard<metered_mutex> lock2 {user_mutex};
+		std::lock_guard<metered_mutex> lock3 {storage_mutex};
 		auto storage = state.user_get_storage(item.user);
-		auto current = state.storage_get_current(storage, item.cid);
-		if (current < item.volume) continue;
-		state.storage_set_current(storage, item.cid, current - item.volume);
+		auto current = stockpiles.get(storage, item.cid);
+		if (current < item.volume) {
+			resolve_ticket(queued.ticket, command_outcome::rejected);
+			continue;
+		}
+		stockpiles.set(storage, item.cid, (int32_t)(current - item.volume));
 		auto supply = state.create_supply();
 		state.supply_set_storage(supply, item.volume);
 		state.supply_set_price(supply, item.price);
 		state.supply_set_cid(supply, item.cid);
 		state.force_create_supply_ownership(supply, item.user);
+		add_to_order_book(supply);
+		resolve_ticket(queued.ticket, command_outcome::applied);
 	}
-	supply_requests_queue.left = supply_requests_queue.right;
-	supply_requests_queue.mtx.unlock();
 
-	// production
-	state.for_each_building([&](dcon::building_id building){
-		std::lock_guard<std::mutex> lock {buildings_mutex};
-		if (!state.building_get_constructed(building)) {
-			return;
-		}
-		auto user = state.building_get_owner_from_ownership(building);
-		auto activity = state.building_get_activity(building);
-		auto storage = state.building_get_storage(building);
-		bool inputs_ready = true;
-		for (int i = 0; i < max_inputs; i++) {
-			auto input = state.activity_get_input(activity, i);
-			if(!input) break;
-			auto input_amount = state.activity_get_input_amount(activity, i);
-			auto stockpile = state.storage_get_current(storage, input);
-			if (stockpile < input_amount) {
-				inputs_ready = false;
-				break;
-			}
-		}
-
-		if (inputs_ready) {
-			for (int i = 0; i < max_inputs; i++) {
-				auto input = state.activity_get_input(activity, i);
-				if(!input) break;
+	timer.next(tick_phase::market);
+	// market
+	{
+		std::lock(demand_mutex, supply_mutex, storage_mutex, user_mutex);
+		std::lock_guard<metered_mutex> lock (demand_mutex, std::adopt_lock);
+		std::lock_guard<metered_mutex> lock2 (supply_mutex, std::adopt_lock);
+		std::lock_guard<metered_mutex> lock3 (storage_mutex, std::adopt_lock);
+		std::lock_guard<metered_mutex> lock4 (user_mutex, std::adopt_lock);
+
+		tbb::parallel_for((uint32_t)0, (uint32_t)order_books.size(), [&](uint32_t raw_cid){
+			auto cid = dcon::commodity_id {(dcon::commodity_id::value_base_t)raw_cid};
+			match_orders(cid, order_books[raw_cid]);
+		});
 
-				auto input_amount = state.activity_get_input_amount(activity, i);
-				auto stockpile = state.storage_get_current(storage, input);
-				state.storage_set_current(storage, input, stockpile - input_amount);
+		std::lock_guard<metered_mutex> lock5 {savings_mutex};
+		for (uint32_t raw_cid = 0; raw_cid < order_books.size(); raw_cid++) {
+			auto& book = order_books[raw_cid];
+			auto cid = dcon::commodity_id {(dcon::commodity_id::value_base_t)raw_cid};
+			for (auto& item : book.settlements) {
+				state.user_set_wealth(item.user, state.user_get_wealth(item.user) + item.amount);
 			}
-
-			for (int i = 0; i < max_outputs; i++) {
-				auto output = state.activity_get_output(activity, i);
-				if(!output) break;
-				auto output_amount = state.activity_get_output_amount(activity, i);
-				auto stockpile = state.storage_get_current(storage, output);
-				state.storage_set_current(storage, output, stockpile + output_amount);
+			for (auto& item : book.deliveries) {
+				stockpiles.add(item.storage, cid, item.amount);
+			}
+			for (auto demand : book.filled_demands) {
+				state.delete_demand(demand);
+			}
+			for (auto supply : book.filled_supplies) {
+				state.delete_supply(supply);
 			}
 		}
-	});
+	}
+
+	timer.next(tick_phase::production);
+	// production
+	{
+		std::lock_guard<metered_mutex> lock {buildings_mutex};
+		if (production_groups_dirty) {
+			rebuild_production_groups();
+		}
+		// storages are changed in parallel below, none of them may grow the table
+		stockpiles.resize(state.storage_size(), state.commodity_size());
+		for (uint32_t raw_aid = 0; raw_aid < production_groups.size(); raw_aid++) {
+			auto& group = production_groups[raw_aid];
+			if (group.empty()) continue;
+			run_production(dcon::activity_id {(dcon::activity_id::value_base_t)raw_aid}, group);
+		}
+	}
 
 
+	timer.next(tick_phase::construction_siphon);
 	// construction siphons commodities directly
 	buildings_mutex.lock();
 	state.for_each_building([&](dcon::building_id building){
-		std::lock_guard<std::mutex> lock2 {storage_mutex};
+		std::lock_guard<metered_mutex> lock2 {storage_mutex};
 		if (state.building_get_constructed(building)) {
 			return;
 		}
@@ -951,13 +1920,13 @@ void simulation_update() {
 			auto input = state.building_type_get_construction(btid, i);
 			if(!input) break;
 			auto input_amount = state.building_type_get_construction_amount(btid, i);
-			auto stockpile = state.storage_get_current(storage, input);
-			auto user_stockpile = state.storage_get_current(user_storage, input);
+			auto stockpile = stockpiles.get(storage, input);
+			auto user_stockpile = stockpiles.get(user_storage, input);
 			if (stockpile < input_amount) {
 				inputs_ready = false;
 				if (user_stockpile > 0) {
-					state.storage_set_current(user_storage, input, user_stockpile - 1);
-					state.storage_set_current(storage, input, stockpile + 1);
+					stockpiles.set(user_storage, input, user_stockpile - 1);
+					stockpiles.set(storage, input, stockpile + 1);
 				}
 			}
 		}
@@ -966,27 +1935,223 @@ void simulation_update() {
 			for (int i = 0; i < max_inputs; i++) {
 				auto input = state.building_type_get_construction(btid, i);
 				if(!input) break;
-				auto input_amount = state.building_type_get_construction_amount(btid, i);
-				auto stockpile = state.storage_get_current(storage, input);
-				state.storage_set_current(storage, input, 0);
+				stockpiles.set(storage, input, 0);
 			}
 			state.building_set_constructed(building, true);
+			production_groups_dirty = true;
 		}
 	});
 	buildings_mutex.unlock();
 
+	timer.next(tick_phase::transfer_flow);
 	// update operation
-	tbb::parallel_for((uint32_t)0, state.commodity_size(), [&](uint32_t raw_cid){
-		auto cid = dcon::commodity_id {(dcon::commodity_id::value_base_t)raw_cid};
-		state.execute_serial_over_transfer([&](auto t){
-			auto source = state.transfer_get_source(t);
-			auto target = state.transfer_get_target(t);
-			auto available = state.storage_get_current(source, cid);
-			auto movement = state.transfer_get_current(t, cid);
-			auto present = state.storage_get_current(target, cid);
-			auto actual_movement = ve::select(movement < available, movement, 0);
-			state.storage_set_current(target, cid, present + actual_movement);
-			state.storage_set_current(source, cid, state.storage_get_current(source, cid) - actual_movement);
-		});
-	});
+	{
+		std::lock_guard<metered_mutex> lock {transfer_mutex};
+		update_transfers();
+	}
+
+	current_tick++;
+	timer.next(tick_phase::publish);
+	publish_view();
+	timer.next(tick_phase::persistence);
+	world_log.sync();
+	recording_log.sync();
+
+	if (snapshot_interval > 0 && current_tick % snapshot_interval == 0) {
+		if (save_snapshot(snapshot_file.c_str())) {
+			world_log.truncate();
+		} else {
+			printf("Failed to save a snapshot to %s\n", snapshot_file.c_str());
+		}
+	}
+}
+
+void simulation_update() {
+	std::lock_guard<metered_mutex> lock {tick_mutex};
+	auto start = std::chrono::steady_clock::now();
+	run_tick();
+	record_tick(std::chrono::steady_clock::now() - start);
+}
+
+template<typename T>
+static void replay_command(command_queue<ticketed<T>>& queue, log_record const& record) {
+	if (record.header.size != sizeof(T)) return;
+	T item;
+	memcpy(&item, record.data, sizeof(T));
+	if (!queue.push({item, {}})) {
+		printf("Command dropped during replay, COMMAND_QUEUE_CAPACITY is too small\n");
+	}
+}
+
+// Reapplies ticks recorded after the current one, returns the amount of replayed ticks.
+static uint64_t replay_log(const char* path, tick_observer const& on_tick = {}) {
+	command_log_reader reader;
+	if (!reader.open(path)) return 0;
+
+	uint64_t replayed = 0;
+	bool pending = false;
+	auto finish_tick = [&]() {
+		if (!pending) return;
+		auto tick = current_tick;
+		auto start = std::chrono::steady_clock::now();
+		run_tick();
+		if (on_tick) on_tick(tick, std::chrono::steady_clock::now() - start);
+		replayed++;
+		pending = false;
+	};
+
+	log_record record;
+	while (reader.next(record)) {
+		if (record.header.tick < current_tick) continue;
+		switch (record.header.type) {
+		case log_record_type::tick:
+			finish_tick();
+			// ticks logged by older versions carried a 32 bit reseed instead of the world seed
+			if (record.header.size == sizeof(world_seed)) {
+				memcpy(&world_seed, record.data, sizeof(world_seed));
+			}
+			pending = true;
+			break;
+		case log_record_type::user: {
+			// users are never created in the middle of a tick
+			finish_tick();
+			if (record.header.size != sizeof(user_record)) break;
+			user_record item;
+			memcpy(&item, record.data, sizeof(user_record));
+			item.name[MAXNAMESIZE - 1] = 0;
+			create_user(item.name, item.password_hash);
+			break;
+		}
+		case log_record_type::gacha:
+			replay_command(gacha_queue, record);
+			break;
+		case log_record_type::construction:
+			replay_command(construction_requests_queue, record);
+			break;
+		case log_record_type::settings:
+			replay_command(building_settings_queue, record);
+			break;
+		case log_record_type::transfer:
+			replay_command(transfer_requests_queue, record);
+			break;
+		case log_record_type::demand:
+			replay_command(demand_requests_queue, record);
+			break;
+		case log_record_type::supply:
+			replay_command(supply_requests_queue, record);
+			break;
+		}
+	}
+	finish_tick();
+
+	return replayed;
+}
+
+recovery_result recover_simulation(const char* snapshot_path, const char* log_path) {
+	auto start = std::chrono::steady_clock::now();
+	std::lock_guard<metered_mutex> lock {tick_mutex};
+	auto loaded = load_snapshot(snapshot_path);
+	if (loaded != recovery_result::loaded) return loaded;
+	auto snapshot_tick = current_tick;
+	auto replayed = replay_log(log_path);
+	publish_view();
+	auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+	printf(
+		"Recovered tick %llu from %s and replayed %llu ticks from %s in %lld ms\n",
+		(unsigned long long)snapshot_tick,
+		snapshot_path,
+		(unsigned long long)replayed,
+		log_path,
+		(long long)duration.count()
+	);
+	return recovery_result::loaded;
+}
+
+void start_persistence(const char* snapshot_path, const char* log_path, uint64_t interval_ticks) {
+	std::lock_guard<metered_mutex> lock {tick_mutex};
+	snapshot_file = snapshot_path;
+	// the log only makes sense on top of a snapshot of the current tick
+	if (!save_snapshot(snapshot_path)) {
+		printf("Failed to save a snapshot to %s, persistence is disabled\n", snapshot_path);
+		return;
+	}
+	if (!world_log.open(log_path)) {
+		printf("Failed to open %s, persistence is disabled\n", log_path);
+		return;
+	}
+	world_log.truncate();
+	snapshot_interval = interval_ticks;
+}
+
+void stop_persistence() {
+	world_log.close();
+}
+
+static std::string recording_snapshot_path(const char* log_path) {
+	return std::string(log_path) + ".snapshot";
+}
+
+// tick the world reaches once the whole recording is replayed, empty when it is empty or its tail is torn
+static std::optional<uint64_t> recording_end_tick(const char* log_path) {
+	command_log_reader reader;
+	if (!reader.open(log_path)) return {};
+	std::optional<uint64_t> end;
+	log_record record;
+	while (reader.next(record)) {
+		// commands carry the tick they belong to, users are created between ticks
+		if (record.header.type == log_record_type::tick) {
+			end = record.header.tick + 1;
+		} else if (record.header.type == log_record_type::user) {
+			end = record.header.tick;
+		}
+	}
+	if (reader.position != reader.size) return {};
+	return end;
+}
+
+bool start_recording(const char* log_path) {
+	std::lock_guard<metered_mutex> lock {tick_mutex};
+	auto snapshot_path = recording_snapshot_path(log_path);
+	// a recording survives restarts when recovery continued exactly where its last tick ended,
+	// any other world, like a new one after a failed recovery, starts it over
+	struct stat info;
+	bool fresh = stat(snapshot_path.c_str(), &info) != 0;
+	if (!fresh) {
+		auto end = recording_end_tick(log_path);
+		fresh = !end || *end != current_tick;
+		if (end && *end != current_tick) {
+			printf(
+				"%s ends at tick %llu but the world is at tick %llu, starting a new recording\n",
+				log_path,
+				(unsigned long long)*end,
+				(unsigned long long)current_tick
+			);
+		}
+	}
+	if (fresh && !save_snapshot(snapshot_path.c_str())) {
+		printf("Failed to save a snapshot to %s, recording is disabled\n", snapshot_path.c_str());
+		return false;
+	}
+	if (!recording_log.open(log_path)) {
+		printf("Failed to open %s, recording is disabled\n", log_path);
+		return false;
+	}
+	if (fresh) recording_log.truncate();
+	return true;
+}
+
+void stop_recording() {
+	recording_log.close();
+}
+
+uint64_t replay_recording(const char* log_path, tick_observer const& on_tick) {
+	std::lock_guard<metered_mutex> lock {tick_mutex};
+	auto snapshot_path = recording_snapshot_path(log_path);
+	if (load_snapshot(snapshot_path.c_str()) != recovery_result::loaded) {
+		printf("Failed to load %s\n", snapshot_path.c_str());
+		return 0;
+	}
+	auto replayed = replay_log(log_path, on_tick);
+	publish_view();
+	return replayed;
 }
\ No newline at end of file
@@ -1,26 +1,76 @@
+#pragma once
 #include "data_ids.hpp"
+#include <chrono>
+#include <functional>
+#include <memory>
 #include <string>
+#include <vector>
+#include "command_ticket.hpp"
 #include "constants.hpp"
+#include "inventory.hpp"
+
+// immutable copy of the world published after every tick
+struct world_view;
+struct html_writer;
+
+enum class request_status {
+	accepted, rejected, queue_full
+};
 
 void init_simulation();
+// before the world is created or loaded, stockpiles are dense unless a world has many commodities
+void configure_stockpiles(inventory_layout layout);
+// capacities below 1 fall back to the default one, larger ones are clamped
+void configure_command_queues(int64_t capacity);
 void simulation_update();
+
+enum class recovery_result {
+	// there is no snapshot, a new world can be created
+	none,
+	loaded,
+	// the snapshot exists but can't be loaded, starting over would overwrite it
+	failed
+};
+
+// loads the snapshot and replays the log on top of it
+recovery_result recover_simulation(const char* snapshot_path, const char* log_path);
+void start_persistence(const char* snapshot_path, const char* log_path, uint64_t interval_ticks);
+void stop_persistence();
+
+// Recording keeps every command since it started in a log which is never truncated,
+// next to a snapshot of the tick it started at. Replaying it reproduces the same ticks.
+using tick_observer = std::function<void(uint64_t tick, std::chrono::steady_clock::duration duration)>;
+bool start_recording(const char* log_path);
+void stop_recording();
+uint64_t replay_recording(const char* log_path, tick_observer const& on_tick);
+
 dcon::user_id create_or_get_user(std::string name, uint8_t password_hash[HASHLEN]);
-std::string trade_section(dcon::user_id user);
 
-bool request_new_building(dcon::user_id user, dcon::building_type_id building_type);
-bool request_settings_change(dcon::user_id user, dcon::building_id building, int i);
-bool request_transfer(dcon::user_id user, dcon::storage_id s,  dcon::storage_id t, dcon::commodity_id cid, int volume);
-bool request_demand(dcon::user_id user, dcon::commodity_id cid, __uint128_t price, __uint128_t volume);
-bool request_gacha(dcon::user_id user, int count);
+std::shared_ptr<const world_view> acquire_view();
+uint64_t view_tick(world_view const& view);
+// changes only when building types or activities change
+uint64_t catalog_version();
+bool view_has_user(world_view const& view, dcon::user_id user);
+std::vector<dcon::building_id> retrieve_owned_buildings(world_view const& view, dcon::user_id user);
+dcon::storage_id retrieve_building_storage(world_view const& view, dcon::building_id building);
+dcon::storage_id retrieve_user_storage(world_view const& view, dcon::user_id user);
+
+void trade_section(html_writer& out, world_view const& view, dcon::user_id user);
 
+// the ticket, if any, is resolved by the tick which applies or rejects the command
+request_status request_new_building(dcon::user_id user, dcon::building_type_id building_type, command_ticket ticket = {});
+request_status request_settings_change(dcon::user_id user, dcon::building_id building, int i, command_ticket ticket = {});
+request_status request_transfer(dcon::user_id user, dcon::storage_id s,  dcon::storage_id t, dcon::commodity_id cid, int volume, command_ticket ticket = {});
+request_status request_demand(dcon::user_id user, dcon::commodity_id cid, __uint128_t price, __uint128_t volume, command_ticket ticket = {});
+request_status request_supply(dcon::user_id user, dcon::commodity_id cid, __uint128_t price, __uint128_t volume, command_ticket ticket = {});
+request_status request_gacha(dcon::user_id user, int count, command_ticket ticket = {});
 
-std::string retrieve_user_name(dcon::user_id user);
-std::string retrieve_user_report_body(dcon::user_id user);
-std::string retrieve_building_report_body(dcon::building_id building);
-std::string retrieve_activity_report_body(dcon::activity_id activity);
-std::string retrieve_building_type_list();
-std::string make_building_type_report(dcon::building_type_id btid);
-std::string make_building_report(dcon::building_id bid);
+
+void retrieve_user_name(html_writer& out, world_view const& view, dcon::user_id user);
+void retrieve_user_report_body(html_writer& out, world_view const& view, dcon::user_id user);
+void retrieve_building_type_list(html_writer& out, world_view const& view);
+void make_building_type_report(html_writer& out, dcon::building_type_id btid);
+void make_building_report(html_writer& out, dcon::building_id bid);
 
 
 /*
@@ -30,4 +80,10 @@ Stats
 */
 
 
-uint32_t pulls_count(dcon::user_id user) ;
\ No newline at end of file
+uint32_t pulls_count(dcon::user_id user) ;
+uint32_t pulls_count(world_view const& view, dcon::user_id user);
+void write_simulation_metrics(std::string& result);
+
+// for benchmarks: a fixed seed makes runs comparable, the checksum covers stockpiles and savings
+void set_world_seed(uint64_t seed);
+uint64_t world_checksum();
\ No newline at end of file
@@ -0,0 +1,121 @@
+#include "text_store.hpp"
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+static bool escape_html(std::string_view value, std::string& result) {
+	bool changed = false;
+	for (auto c : value) {
+		switch (c) {
+		case '&': result += "&amp;"; changed = true; break;
+		case '<': result += "&lt;"; changed = true; break;
+		case '>': result += "&gt;"; changed = true; break;
+		case '"': result += "&quot;"; changed = true; break;
+		case '\'': result += "&#39;"; changed = true; break;
+		default: result += c;
+		}
+	}
+	return changed;
+}
+
+char const* text_store::store(std::string_view value) {
+	char* result;
+	if (value.size() + 1 > arena_block_size / 4) {
+		// large strings get a block of their own instead of wasting the rest of the current one
+		arena.push_back(std::make_unique<char[]>(value.size() + 1));
+		result = arena.back().get();
+	} else {
+		if (arena_used + value.size() + 1 > arena_block_size) {
+			arena.push_back(std::make_unique<char[]>(arena_block_size));
+			arena_block = arena.back().get();
+			arena_used = 0;
+		}
+		result = arena_block + arena_used;
+		arena_used += value.size() + 1;
+	}
+	memcpy(result, value.data(), value.size());
+	result[value.size()] = '\0';
+	return result;
+}
+
+uint32_t text_store::add(std::string_view value) {
+	auto key = count.load(std::memory_order_relaxed);
+	auto block_index = key / entries_per_block;
+	if (block_index >= max_blocks) {
+		printf("Text store is full, \"%.*s\" was not stored\n", (int)value.size(), value.data());
+		return no_key;
+	}
+	auto block = blocks[block_index].load(std::memory_order_relaxed);
+	if (!block) {
+		owned_blocks.push_back(std::make_unique<entry[]>(entries_per_block));
+		block = owned_blocks.back().get();
+		blocks[block_index].store(block, std::memory_order_release);
+	}
+
+	auto& item = block[key % entries_per_block];
+	item.data = store(value);
+	item.length = (uint32_t)value.size();
+
+	std::string escaped;
+	if (escape_html(value, escaped)) {
+		item.escaped = store(escaped);
+		item.escaped_length = (uint32_t)escaped.size();
+	} else {
+		item.escaped = item.data;
+		item.escaped_length = item.length;
+	}
+
+	count.store(key + 1, std::memory_order_release);
+	return key;
+}
+
+uint32_t text_store::intern(std::string_view value) {
+	std::lock_guard<std::mutex> lock {mtx};
+	auto it = index.find(value);
+	if (it != index.end()) return it->second;
+	auto key = add(value);
+	if (key == no_key) return no_key;
+	index.emplace(get(key), key);
+	return key;
+}
+
+uint32_t text_store::append(std::string_view value) {
+	std::lock_guard<std::mutex> lock {mtx};
+	auto key = add(value);
+	if (key == no_key) return no_key;
+	// the first key of a string stays the canonical one
+	index.emplace(get(key), key);
+	return key;
+}
+
+text_store::entry const& text_store::at(uint32_t key) const {
+	auto block = blocks[key / entries_per_block].load(std::memory_order_acquire);
+	return block[key % entries_per_block];
+}
+
+std::string_view text_store::get(uint32_t key) const {
+	auto& item = at(key);
+	return {item.data, item.length};
+}
+
+std::string_view text_store::escaped(uint32_t key) const {
+	auto& item = at(key);
+	return {item.escaped, item.escaped_length};
+}
+
+uint32_t text_store::size() const {
+	return count.load(std::memory_order_acquire);
+}
+
+void text_store::clear() {
+	std::lock_guard<std::mutex> lock {mtx};
+	index.clear();
+	for (auto& block : blocks) {
+		block.store(nullptr, std::memory_order_relaxed);
+	}
+	owned_blocks.clear();
+	arena.clear();
+	arena_block = nullptr;
+	arena_used = arena_block_size;
+	count.store(0, std::memory_order_release);
+}
@@ -0,0 +1,64 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <vector>
+#include "unordered_dense.h"
+
+/*
+
+Interned strings of the world: names of users, commodities, activities and building types.
+Characters live in an append-only arena and entries in fixed blocks, so neither ever moves:
+views handed out stay valid for the lifetime of the store and readers never take a lock.
+Every string keeps an HTML escaped twin, which is the same bytes when nothing needs escaping.
+
+*/
+
+struct text_store {
+	struct entry {
+		char const* data;
+		char const* escaped;
+		uint32_t length;
+		uint32_t escaped_length;
+	};
+
+	static constexpr size_t entries_per_block = 4096;
+	static constexpr size_t max_blocks = 1024;
+	static constexpr size_t arena_block_size = 64 * 1024;
+	// returned by intern and append once every block is taken, it must never be stored
+	static constexpr uint32_t no_key = UINT32_MAX;
+
+	text_store() = default;
+	text_store(text_store const&) = delete;
+	text_store& operator=(text_store const&) = delete;
+
+	// returns the key of an equal string when there is one, no_key when the store is full
+	uint32_t intern(std::string_view value);
+	// always creates a new key, used when keys must match a saved world; no_key when the store is full
+	uint32_t append(std::string_view value);
+
+	std::string_view get(uint32_t key) const;
+	std::string_view escaped(uint32_t key) const;
+	uint32_t size() const;
+
+	// not thread safe: only before readers start
+	void clear();
+
+private:
+	std::array<std::atomic<entry*>, max_blocks> blocks {};
+	std::vector<std::unique_ptr<entry[]>> owned_blocks;
+	std::vector<std::unique_ptr<char[]>> arena;
+	char* arena_block = nullptr;
+	size_t arena_used = arena_block_size;
+	std::atomic<uint32_t> count {0};
+
+	std::mutex mtx;
+	ankerl::unordered_dense::map<std::string_view, uint32_t> index;
+
+	entry const& at(uint32_t key) const;
+	char const* store(std::string_view value);
+	uint32_t add(std::string_view value);
+};
@@ -0,0 +1,72 @@
+#include "tick_scheduler.hpp"
+#include <algorithm>
+#include <format>
+
+tick_scheduler::tick_scheduler(
+	std::chrono::steady_clock::duration period,
+	overrun_policy policy,
+	uint32_t max_catch_up,
+	std::function<void()> callback
+) : period(std::max<std::chrono::steady_clock::duration>(period, std::chrono::milliseconds(1))),
+	policy(policy), max_catch_up(max_catch_up), callback(std::move(callback)) {}
+
+tick_scheduler::~tick_scheduler() {
+	stop();
+}
+
+void tick_scheduler::start() {
+	{
+		std::lock_guard<std::mutex> lock {mtx};
+		stopping = false;
+	}
+	worker = std::thread([this]() { run(); });
+}
+
+void tick_scheduler::stop() {
+	{
+		std::lock_guard<std::mutex> lock {mtx};
+		stopping = true;
+	}
+	wake.notify_all();
+	if (worker.joinable()) {
+		worker.join();
+	}
+}
+
+void tick_scheduler::run() {
+	auto deadline = std::chrono::steady_clock::now() + period;
+	std::unique_lock<std::mutex> lock {mtx};
+	while (true) {
+		if (wake.wait_until(lock, deadline, [&]() { return stopping; })) {
+			return;
+		}
+		lock.unlock();
+		callback();
+		ticks.fetch_add(1, std::memory_order_relaxed);
+		lock.lock();
+
+		deadline += period;
+		auto now = std::chrono::steady_clock::now();
+		if (now < deadline) continue;
+
+		overruns.fetch_add(1, std::memory_order_relaxed);
+		uint64_t behind = (now - deadline) / period + 1;
+		uint64_t dropped = 0;
+		if (policy == overrun_policy::skip) {
+			dropped = behind;
+		} else if (behind > max_catch_up) {
+			dropped = behind - max_catch_up;
+		}
+		deadline += period * dropped;
+		skipped.fetch_add(dropped, std::memory_order_relaxed);
+	}
+}
+
+void tick_scheduler::write_metrics(std::string& result) const {
+	result += "# TYPE scheduler_ticks_total counter\n";
+	result += std::format("scheduler_ticks_total {}\n", ticks.load(std::memory_order_relaxed));
+	result += "# TYPE scheduler_overruns_total counter\n";
+	result += std::format("scheduler_overruns_total {}\n", overruns.load(std::memory_order_relaxed));
+	result += "# TYPE scheduler_skipped_ticks_total counter\n";
+	result += std::format("scheduler_skipped_ticks_total {}\n", skipped.load(std::memory_order_relaxed));
+}
@@ -0,0 +1,57 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+/*
+
+Runs a callback on a fixed timestep.
+Deadlines are absolute points on a steady clock, so time spent inside the callback doesn't drift the schedule.
+
+*/
+
+enum class overrun_policy {
+	// run missed ticks back to back, at most max_catch_up of them
+	catch_up,
+	// drop missed ticks and wait for the next deadline on the grid
+	skip
+};
+
+struct tick_scheduler {
+	// at least a millisecond, shorter periods are clamped
+	std::chrono::steady_clock::duration period;
+	overrun_policy policy;
+	uint32_t max_catch_up;
+	std::function<void()> callback;
+
+	std::atomic<uint64_t> ticks {0};
+	std::atomic<uint64_t> overruns {0};
+	std::atomic<uint64_t> skipped {0};
+
+	tick_scheduler(
+		std::chrono::steady_clock::duration period,
+		overrun_policy policy,
+		uint32_t max_catch_up,
+		std::function<void()> callback
+	);
+	~tick_scheduler();
+
+	void start();
+	// waits for the running tick to finish
+	void stop();
+
+	void write_metrics(std::string& result) const;
+
+private:
+	std::thread worker;
+	std::mutex mtx;
+	std::condition_variable wake;
+	bool stopping = false;
+
+	void run();
+};
@@ -0,0 +1,96 @@
+#include "transfer_table.hpp"
+#include <algorithm>
+
+static bool edge_before(transfer_edge const& a, transfer_edge const& b) {
+	if (a.cid.index() != b.cid.index()) return a.cid.index() < b.cid.index();
+	if (a.source.index() != b.source.index()) return a.source.index() < b.source.index();
+	return a.target.index() < b.target.index();
+}
+
+static bool same_edge(transfer_edge const& a, transfer_edge const& b) {
+	return a.cid.index() == b.cid.index()
+		&& a.source.index() == b.source.index()
+		&& a.target.index() == b.target.index();
+}
+
+// counting sort of edge positions by storage, positions of one storage stay in edge order
+template<typename K>
+static void group_by_storage(
+	std::vector<transfer_edge> const& edges,
+	uint32_t storages,
+	std::vector<uint32_t>& offsets,
+	std::vector<uint32_t>& positions,
+	K key
+) {
+	offsets.assign(storages + 1, 0);
+	for (auto& edge : edges) {
+		offsets[key(edge) + 1]++;
+	}
+	for (uint32_t s = 0; s < storages; s++) {
+		offsets[s + 1] += offsets[s];
+	}
+	positions.resize(edges.size());
+	std::vector<uint32_t> next(offsets.begin(), offsets.end() - 1);
+	for (uint32_t i = 0; i < edges.size(); i++) {
+		positions[next[key(edges[i])]++] = i;
+	}
+}
+
+std::shared_ptr<const transfer_table> change_transfers(
+	transfer_table const& table,
+	std::vector<transfer_edge> const& changes,
+	uint32_t storages,
+	uint32_t commodities
+) {
+	auto result = std::make_shared<transfer_table>();
+	auto& edges = result->edges;
+
+	// stable, so of equal edges the latest change comes last
+	std::vector<transfer_edge> sorted_changes = changes;
+	std::stable_sort(sorted_changes.begin(), sorted_changes.end(), edge_before);
+
+	edges.reserve(table.edges.size() + sorted_changes.size());
+	auto old_edge = table.edges.begin();
+	for (size_t i = 0; i < sorted_changes.size(); i++) {
+		auto& change = sorted_changes[i];
+		if (i + 1 < sorted_changes.size() && same_edge(change, sorted_changes[i + 1])) continue;
+		while (old_edge != table.edges.end() && edge_before(*old_edge, change)) {
+			edges.push_back(*old_edge++);
+		}
+		if (old_edge != table.edges.end() && same_edge(*old_edge, change)) {
+			old_edge++;
+		}
+		if (change.volume != 0) {
+			edges.push_back(change);
+		}
+	}
+	edges.insert(edges.end(), old_edge, table.edges.end());
+
+	for (auto& edge : edges) {
+		storages = std::max<uint32_t>(storages, std::max(edge.source.index(), edge.target.index()) + 1);
+		commodities = std::max<uint32_t>(commodities, edge.cid.index() + 1);
+	}
+
+	result->commodity_offsets.assign(commodities + 1, 0);
+	for (auto& edge : edges) {
+		result->commodity_offsets[edge.cid.index() + 1]++;
+	}
+	for (uint32_t c = 0; c < commodities; c++) {
+		result->commodity_offsets[c + 1] += result->commodity_offsets[c];
+	}
+
+	group_by_storage(edges, storages, result->source_offsets, result->by_source, [](auto const& edge) {
+		return (uint32_t)edge.source.index();
+	});
+	group_by_storage(edges, storages, result->target_offsets, result->by_target, [](auto const& edge) {
+		return (uint32_t)edge.target.index();
+	});
+	return result;
+}
+
+size_t transfer_table::memory_bytes() const {
+	return edges.capacity() * sizeof(transfer_edge)
+		+ (commodity_offsets.capacity()
+			+ source_offsets.capacity() + by_source.capacity()
+			+ target_offsets.capacity() + by_target.capacity()) * sizeof(uint32_t);
+}
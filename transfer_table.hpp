@@ -0,0 +1,65 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "data_ids.hpp"
+
+/*
+
+Transfers as a compressed edge list.
+An edge moves up to volume of one commodity from source to target every tick,
+edges are sorted by commodity, then source, then target, and only non-zero volumes are kept.
+Edges leaving one stockpile are neighbours, so the flow pass streams over them,
+while two indices grouped by storage give the building page its incoming and outgoing edges.
+
+Tables are immutable once built: a change builds a new table, which the published view shares.
+
+*/
+
+struct transfer_edge {
+	dcon::storage_id source;
+	dcon::storage_id target;
+	dcon::commodity_id cid;
+	int32_t volume;
+};
+
+struct transfer_table {
+	std::vector<transfer_edge> edges;
+	// edges of commodity c are edges[commodity_offsets[c], commodity_offsets[c + 1])
+	std::vector<uint32_t> commodity_offsets;
+	// positions in edges grouped by storage, in edge order:
+	// by_source[source_offsets[s], source_offsets[s + 1]) are the edges leaving storage s
+	std::vector<uint32_t> source_offsets;
+	std::vector<uint32_t> by_source;
+	std::vector<uint32_t> target_offsets;
+	std::vector<uint32_t> by_target;
+
+	template<typename F>
+	void for_each_outgoing(dcon::storage_id storage, F&& f) const {
+		for_each_in(source_offsets, by_source, storage, f);
+	}
+	template<typename F>
+	void for_each_incoming(dcon::storage_id storage, F&& f) const {
+		for_each_in(target_offsets, by_target, storage, f);
+	}
+
+	size_t memory_bytes() const;
+
+private:
+	template<typename F>
+	void for_each_in(std::vector<uint32_t> const& offsets, std::vector<uint32_t> const& positions, dcon::storage_id storage, F& f) const {
+		if (storage.index() + 1 >= (int32_t)offsets.size()) return;
+		for (auto i = offsets[storage.index()]; i < offsets[storage.index() + 1]; i++) {
+			f(edges[positions[i]]);
+		}
+	}
+};
+
+// Edges of changes replace edges of the table with the same source, target and commodity,
+// later changes win over earlier ones and a volume of zero removes the edge.
+std::shared_ptr<const transfer_table> change_transfers(
+	transfer_table const& table,
+	std::vector<transfer_edge> const& changes,
+	uint32_t storages,
+	uint32_t commodities
+);
@@ -9,59 +9,80 @@ void set_base_prefix(std::string prefix){
 	BASE_PREFIX = prefix;
 }
 
+std::string const& base_prefix() {
+	return BASE_PREFIX;
+}
+
+std::optional<std::string_view> local_path(const char* url) {
+	std::string_view path {url};
+	if (!path.starts_with(BASE_PREFIX)) return std::nullopt;
+	return path.substr(BASE_PREFIX.size());
+}
+
+static std::string full(std::string_view path) {
+	std::string result;
+	result.reserve(BASE_PREFIX.size() + path.size() + 16);
+	result += BASE_PREFIX;
+	result += path;
+	return result;
+}
+
 // GET
 std::string main_mage() {
 	return BASE_PREFIX;
 }
+std::string metrics() {
+	return full(url_path::metrics);
+}
 std::string gacha_page() {
-	return BASE_PREFIX + "gacha";
+	return full(url_path::gacha_page);
 }
 std::string building() {
-	return BASE_PREFIX + "building";
+	return full(url_path::building);
 }
 std::string building_type() {
-	return (BASE_PREFIX + "building_type");
+	return full(url_path::building_type);
 }
 std::string building(int index) {
-	return (BASE_PREFIX + "building?id=") + std::to_string(index);
+	return full(url_path::building) + "?id=" + std::to_string(index);
 }
 std::string building_type(int index) {
-	return (BASE_PREFIX + "building_type?id=") + std::to_string(index);
+	return full(url_path::building_type) + "?id=" + std::to_string(index);
 }
 
 // POST
 std::string new_user() {
-	return BASE_PREFIX + "login";
+	return full(url_path::new_user);
 }
 std::string new_building() {
-	return BASE_PREFIX + "building/create";
+	return full(url_path::new_building);
 }
 std::string set_building() {
-	return BASE_PREFIX + "building/set";
+	return full(url_path::set_building);
 }
 std::string set_transfer() {
-	return BASE_PREFIX + "transfer/set";
+	return full(url_path::set_transfer);
 }
 std::string activity(int index) {
-	return BASE_PREFIX + "activity?id=" + std::to_string(index);
+	return full(url_path::activity) + "?id=" + std::to_string(index);
 }
 std::string supply(int index) {
-	return BASE_PREFIX + "supply?id=" + std::to_string(index);
+	return full(url_path::supply) + "?id=" + std::to_string(index);
 }
 std::string demand(int index) {
-	return BASE_PREFIX + "demand?id=" + std::to_string(index);
+	return full(url_path::demand) + "?id=" + std::to_string(index);
 }
 std::string new_demand() {
-	return BASE_PREFIX + "demand/create";
+	return full(url_path::new_demand);
 }
 std::string new_supply() {
-	return BASE_PREFIX + "supply/create";
+	return full(url_path::new_supply);
 }
 
 std::string ten_pull() {
-	return BASE_PREFIX + "pull_ten";
+	return full(url_path::ten_pull);
 }
 std::string one_pull(){
-	return BASE_PREFIX + "pull_one";
+	return full(url_path::one_pull);
 }
 }
\ No newline at end of file
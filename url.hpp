@@ -1,12 +1,41 @@
 #pragma once
+#include <optional>
 #include <string>
+#include <string_view>
+
+// paths relative to the base prefix, shared by links and the router
+namespace url_path {
+// GET
+inline constexpr std::string_view main_page = "";
+inline constexpr std::string_view metrics = "metrics";
+inline constexpr std::string_view gacha_page = "gacha";
+inline constexpr std::string_view building = "building";
+inline constexpr std::string_view building_type = "building_type";
+inline constexpr std::string_view activity = "activity";
+inline constexpr std::string_view supply = "supply";
+inline constexpr std::string_view demand = "demand";
+
+// POST
+inline constexpr std::string_view new_user = "login";
+inline constexpr std::string_view new_building = "building/create";
+inline constexpr std::string_view set_building = "building/set";
+inline constexpr std::string_view set_transfer = "transfer/set";
+inline constexpr std::string_view new_demand = "demand/create";
+inline constexpr std::string_view new_supply = "supply/create";
+inline constexpr std::string_view ten_pull = "pull_ten";
+inline constexpr std::string_view one_pull = "pull_one";
+}
 
 namespace url_gen {
 
 void set_base_prefix(std::string prefix);
+std::string const& base_prefix();
+// path of the url without the base prefix, nothing when the url is outside of it
+std::optional<std::string_view> local_path(const char* url);
 
 // GET
 std::string main_mage();
+std::string metrics();
 std::string gacha_page();
 std::string building();
 std::string building_type();